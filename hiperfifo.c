@@ -45,38 +45,69 @@ Or a whole bunch of them:
 The fifo buffer is handled almost instantly, so you can even add more URL's
 while the previous requests are still being downloaded.
 
-Note:
-  For the sake of simplicity, URL length is limited to 1023 char's !
+URL's are separated by any whitespace and may be of any length.
+A number before a URL is its priority lane, 0 being the most urgent:
+  % echo 0 http://www.yahoo.com/news > hiper.fifo
 
 This is purely a demo app, all retrieved data is simply discarded by the write
 callback.
 
   g++ -Wall -W -L/usr/libevent/lib -I/usr/libevent/include hiperfifo.c
 
-  g++ -Wall -W -lcurl -levent -lmysqlclient -L/usr/libevent/lib -L/usr/lib64/mysql -I/usr/libevent/include -I/usr/include/mysql hiperfifo.c
+  g++ -Wall -W -lcurl -levent -lpthread -lmysqlclient -L/usr/libevent/lib -L/usr/lib64/mysql -I/usr/libevent/include -I/usr/include/mysql hiperfifo.c
 
   LD_LIBRARY_PATH=/usr/libevent/lib ./a.out
 
+  Without MYSQL_DB, pages go to PostgreSQL through a binary COPY (or, with
+  PG_UPSERT, pipelined INSERT ... ON CONFLICT DO NOTHING).  The conninfo
+  string can be given after the options, e.g. to test locally:
+
+  g++ -Wall -W -lcurl -levent -lpthread -lpq -I/usr/include/postgresql hiperfifo.c
+  ./a.out "host=/var/run/postgresql dbname=test"
+
+  The event loop is libevent by default; -b libev (built with -DHAVE_LIBEV
+  -lev, linked after -levent since libev carries libevent look-alikes) or
+  -b epoll select another. -m and -a pick or avoid a method, -e makes our
+  own descriptors edge-triggered and -c turns on libevent's epoll
+  changelist. -B runs a loop benchmark on every backend and exits:
+
+  g++ -O2 -DHAVE_LIBEV hiperfifo.c -levent -lev -lcurl -lpthread -lpq ...
+  ./a.out -B -e
+
+  -T runs the self-test of the scheduler and index structures and exits
+  with 1 if a check failed, for a build to run after compiling.
+
+  With FETCH_THREADS > 1 each thread runs its own event loop and multi
+  handle; the main thread reads the fifo and hands every URL to the thread
+  owning its host, so connections to one host are reused in one place.
+  All easy handles share one CURLSH for DNS, TLS sessions and the public
+  suffix list. Built with -DHAVE_OPENSSL -lssl (libcurl on OpenSSL), the
+  stats tell resumed TLS handshakes from full ones.
+
   CREATE TABLE `writers` (
   `name` TEXT NULL,
   `size` INT(10) UNSIGNED NOT NULL DEFAULT '0',
-  `ts` TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP
+  `url` TEXT NULL,
+  `digest` BIGINT UNSIGNED NULL,
+  `ts` TIMESTAMP NOT NULL DEFAULT CURRENT_TIMESTAMP,
+  INDEX (`digest`)
   )
   COLLATE='utf8_general_ci'
   ENGINE=MyISAM
 ROW_FORMAT=DEFAULT
 
-24*60*60=86400
+  A body seen before (same XXH64 digest) is stored once; later URLs get a
+  row with name NULL and the digest of the row holding it:
 
-  select ts, sum(size)/1000 as 'KB',count(name) as 'URLs'  from `writers`
-  group by `ts`
-with ROLLUP
+  select w.url, b.name from writers w join writers b
+  on b.digest = w.digest and b.name is not null
 
-select min(ts) from writers
-where size > 0
-union
-select max(ts) from writers
-where size > 0
+  Queue depth, transfers, failures, bytes, pages/s and the writers' lag
+  are served as Prometheus text on METRICS_LISTEN, "ip:port" or the path
+  of a unix socket:
+
+  curl -s http://127.0.0.1:9464/metrics
+  curl -s --unix-socket hiper.metrics http://localhost/metrics
 
 */
 
@@ -88,560 +119,5736 @@ where size > 0
 #include <unistd.h>
 #include <sys/poll.h>
 #include <curl/curl.h>
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#endif
+#ifdef HAVE_LIBEV
+#include <ev.h>  /* before libevent, which #defines EV_READ and friends */
+#endif
 #include <event2/event.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <locale.h>
 #include <iconv.h>
+#include <ctype.h>
 
 #define MSG_OUT stdout /* Send info to stdout, change to stderr if you want */
-#define MAX_WEBPAGE_SIZE 500*1024 // max webpage size = 500KB
-#define MAX_PARALLEL_WORKER 150*3 // 12M / 8 = 1.5M * 1000 / 60 = 25
-#define READ_TIMER_SECONDS 4
+#define MAX_WEBPAGE_SIZE (2*1024*1024) // max webpage size = 2MB, memory is only used as bytes arrive
+#define PAGE_CHUNK_SIZE (16*1024)
+#define PAGE_SLAB_CHUNKS 64  // chunks per slab malloc, 1MB
+#define PAGE_MAX_CHUNKS (MAX_WEBPAGE_SIZE/PAGE_CHUNK_SIZE + 1)
+#define MAX_PARALLEL_WORKER (150*3) // max transfers in flight; 12M / 8 = 1.5M * 1000 / 60 = 25
+#define PENDING_MAX_BYTES (64*1024*1024) // stop reading the fifo when queued URLs use this much
+#define PENDING_LOW_BYTES (PENDING_MAX_BYTES/2) // resume reading once below this
+#define STATS_SECONDS 10
+#define FIFO_READ_SIZE (256*1024)  // initial fifo buffer, grows for longer lines
+#define FETCH_THREADS 1     // event loops, each with its own CURLM; URLs are spread by host
+#define CONN_POOL_MAX MAX_PARALLEL_WORKER // idle ConnInfo/easy handles kept for reuse
+#define SOCK_POOL_MAX MAX_PARALLEL_WORKER // idle SockInfo and their watchers kept
+#define DNS_CACHE_SECONDS 300
+#define HTTP2 1             // multiplex over HTTP/2 where TLS (ALPN) offers it, 0 = HTTP/1.1 only
+#define MAX_HOST_CONNECTIONS 8 // per host, more transfers wait for a free stream; 0 = no limit
+#define MAX_TOTAL_CONNECTIONS 0 // over all shards, 0 = no limit
+#define MAX_STREAMS 100     // concurrent HTTP/2 streams per connection
+#define CONN_CACHE_MAX MAX_PARALLEL_WORKER // idle connections kept open, over all shards
+#define ACCEPT_ENCODING "" // offer every encoding curl was built with, decoded as it arrives
+#define STORE_ENCODED 0     // 1: offer gzip only and store it undecoded; name must be BLOB/bytea
+#define HOST_STATS_SLOTS 1024 // hosts with wire/decoded byte counts, per shard
+#define HOST_RATE 10        // transfers started per second per host, 0 = no limit
+#define HOST_BURST 10       // starts a host that was quiet may make at once
+#define HOST_MAX_IN_FLIGHT 32 // transfers running per host
+#define LANES 3             // priority lanes; a line "0 URL" goes to lane 0, the most urgent
+#define LANE_DEFAULT (LANES-1) // URLs without a priority: bulk
+#define LANE_WEIGHTS {16, 4, 1} // starts per round for each lane when draining weighted
+#define LANE_STRICT 0       // 1: always the most urgent lane first, but
+#define LANE_MAX_WAIT_MS 2000 // ... a lane whose host waited this long goes next
+#define RETRY_ATTEMPTS {2, 3, 3, 4, 4, 5} // retries after the first try: dns, connect, timeout, reset, 5xx, 429
+#define RETRY_BASE_MS {30000, 5000, 5000, 1000, 2000, 10000} // first backoff of each, doubled per retry
+#define RETRY_MAX_MS (10*60*1000) // longest backoff; a longer Retry-After gives up at once
+#define CONNECT_TIMEOUT_MS 10000 // reap a transfer not connected by then,
+#define FIRST_BYTE_TIMEOUT_MS 30000 // ... without a response by then,
+#define LOW_SPEED_BYTES 1024 // ... receiving less than this
+#define LOW_SPEED_MS 15000   // ... in this long,
+#define TOTAL_TIMEOUT_MS (5*60*1000) // ... or running longer; 0 = never, reaped ones retry as timeouts
 
 //#define DEBUG
 #define MYSQL_DB
+//#define PG_UPSERT // PostgreSQL: pipelined INSERT ... ON CONFLICT instead of COPY
+
+#define BATCH_ROWS 200      // rows per multi-row INSERT
+#define BATCH_MAX_BYTES (4*1024*1024) // keep a statement under max_allowed_packet
+#define BATCH_FLUSH_MS 200  // flush a partial batch after this long
+#define STMT_MIN_BYTES (64*1024) // MySQL: bigger pages go through a prepared statement, 0 = all
+#define WRITER_THREADS 4    // database connections, independent of MAX_PARALLEL_WORKER
+#define PERSIST_QUEUE_SIZE 4096 // finished pages waiting for a writer, power of 2
+#define TRANSCODE_TO "UTF-8"
+#define DEFAULT_CHARSET "gb18030" // pages that name no charset and aren't UTF-8
+#define CHARSET_SNIFF_BYTES 1024  // look this far for <meta charset>
+#define ICONV_CACHE 8       // converters kept open per writer
+#define DEDUP_MIN_BYTES 512 // smaller bodies are always stored
+#define DIGEST_STRIPES 64   // locks over the digest index, power of 2
+#define DIGEST_FILE "hiper.digests" // digests of stored bodies, reloaded at start
+#define SEEN_FILE "hiper.seen" // URLs read recently, mapped to memory
+#define SEEN_BUCKETS (1 << 22) // 4 URLs each, power of 2; 1 << 25 holds 128M in 512 MB
+#define SEEN_TTL_MINUTES 60 // a URL read again this soon after its fetch is skipped, 0 disables
+#define VALIDATOR_FILE "hiper.validators" // ETag/Last-Modified per URL, reloaded at start
+#define DEAD_LETTER_FILE "hiper.dead" // URLs given up on: url, class, tries, error per line
+#define METRICS_LISTEN "127.0.0.1:9464" // Prometheus text; ip:port, or a unix socket path; "" = off
+#define METRICS_TIMEOUT_MS 5000 // a metrics client that hasn't sent its request by then is dropped
 
 #ifdef MYSQL_DB
 	#include <my_global.h>
 	#include <mysql.h>
 	#include <m_string.h>
-
-	MYSQL *g_pConn = NULL;
 #else
 	#include "libpq-fe.h"
-
-	PGconn *g_pConn = NULL;
 #endif
 
-// --------------------------------
-// global var
-long  g_share_counter = 0;
-
-/* Global information, common to all connections */
-typedef struct _GlobalInfo
+static long long now_ms(void)
 {
-  struct event_base *evbase;
-  struct event *fifo_event;
-  struct event *timer_event;
-  CURLM *multi;
-  int still_running;
-  FILE* input;
-} GlobalInfo;
+  struct timespec ts;
 
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-/* Information associated with a specific easy handle */
-typedef struct _ConnInfo
+static long long now_us(void)
 {
-  CURL *easy;
-  char *url;
-  GlobalInfo *global;
-  char error[CURL_ERROR_SIZE];
-  char content[MAX_WEBPAGE_SIZE];  
-  int cont_len;
-} ConnInfo;
+  struct timespec ts;
 
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-/* Information associated with a specific socket */
-typedef struct _SockInfo
+/* Counters live with the thread that bumps them (a shard, a writer) and
+   only it writes them; the stats and metrics read them from shard 0. A
+   relaxed load and store is a plain add on x86, with no lock prefix and no
+   cache line shared between writers.  A maximum since the last stats tick
+   is the one value both sides change: the owner raises it with COUNT_MAX
+   and the reporter takes and clears it with COUNT_TAKE in one exchange,
+   so a raise is never lost to the reset.  What the reporter needs to
+   remember between ticks (the last_* fields) only it writes. */
+#define COUNT_ADD(c, n) \
+  __atomic_store_n(&(c), __atomic_load_n(&(c), __ATOMIC_RELAXED) + (n), \
+                   __ATOMIC_RELAXED)
+#define COUNT_GET(c) __atomic_load_n(&(c), __ATOMIC_RELAXED)
+#define COUNT_MAX(c, v) \
+  do { \
+    __typeof__(c) cur_ = __atomic_load_n(&(c), __ATOMIC_RELAXED); \
+    while ((v) > cur_ && \
+           !__atomic_compare_exchange_n(&(c), &cur_, (v), 1, \
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) \
+      ; \
+  } while (0)
+#define COUNT_TAKE(c) __atomic_exchange_n(&(c), 0, __ATOMIC_RELAXED)
+
+/* --------------------------------
+   Event loop backends
+
+   The engine only needs fd watchers and one-shot millisecond timers, so
+   it can run over libevent (the default), libev (built with HAVE_LIBEV)
+   or a plain epoll loop with a timer heap. -b picks one, -m/-a choose
+   or avoid a method, -e and -c ask for edge-triggered watchers and the
+   epoll changelist where the backend has them. */
+
+#define WATCH_READ  0x01
+#define WATCH_WRITE 0x02
+
+typedef void (*watch_cb)(int fd, short kind, void *arg);
+
+typedef struct _LoopConfig
 {
-  curl_socket_t sockfd;
-  CURL *easy;
-  int action;
-  long timeout;
-  struct event *ev;
-  int evset;
-  GlobalInfo *global;
-} SockInfo;
+  const char *backend;   /* "libevent", "libev" or "epoll" */
+  const char *method;    /* use only this method, e.g. "poll" */
+  const char *avoid;     /* comma separated methods never to use */
+  int edge;              /* edge-triggered where the watcher allows it */
+  int changelist;        /* libevent: EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST */
+} LoopConfig;
 
+struct _Loop;
 
+/* An fd watcher or a timer */
+typedef struct _Watch
+{
+  struct _Loop *loop;
+  int fd;                /* -1 for timers */
+  short kind;            /* WATCH_READ|WATCH_WRITE while watched */
+  int et;                /* may be edge-triggered: we read until EAGAIN */
+  watch_cb cb;
+  void *arg;
+  struct event *ev;      /* libevent */
+#ifdef HAVE_LIBEV
+  int ev_init;
+  ev_io io;
+  ev_timer tm;
+#endif
+  long long deadline;    /* epoll: when the timer fires, in ms */
+  int heap_idx;          /* epoll: slot in the timer heap, -1 if idle */
+} Watch;
 
-/* Update the event timer after curl_multi library calls */
-static int multi_timer_cb(CURLM *multi, long timeout_ms, GlobalInfo *g)
+typedef struct _LoopOps
 {
-  struct timeval timeout;
-  (void)multi; /* unused */
+  const char *name;
+  int (*init)(struct _Loop *l, const LoopConfig *cfg);
+  void (*done)(struct _Loop *l);
+  void (*run)(struct _Loop *l);
+  void (*stop)(struct _Loop *l);           /* from a callback of this loop */
+  void (*io_set)(Watch *w, short kind);    /* 0 stops watching */
+  void (*timer_set)(Watch *w, long ms);    /* -1 stops the timer */
+  void (*watch_done)(Watch *w);
+} LoopOps;
 
-  timeout.tv_sec = timeout_ms/1000;
-  timeout.tv_usec = (timeout_ms%1000)*1000;  
-  evtimer_add(g->timer_event, &timeout);
-#ifdef DEBUG
-  fprintf(MSG_OUT, "multi_timer_cb: Setting timeout to %ld ms\n", timeout_ms);
+typedef struct _Loop
+{
+  const LoopOps *ops;
+  const char *method;    /* what the backend ended up using */
+  int edge;
+  int coalesces;         /* an interest change is one epoll_ctl, not two */
+  long dispatched;       /* callbacks run */
+  struct event_base *base;
+#ifdef HAVE_LIBEV
+  struct ev_loop *ev;
 #endif
-  return 0;
-}
+  int epfd;
+  int stopping;
+  struct epoll_event *ready;  /* epoll: events of the current round */
+  int nready;
+  Watch **heap;
+  int heap_len;
+  int heap_size;
+} Loop;
 
-/* Die if we get a bad CURLMcode somewhere */
-static void mcode_or_die(const char *where, CURLMcode code)
+/* libevent */
+
+static void lev_cb(evutil_socket_t fd, short what, void *arg)
 {
-  if ( CURLM_OK != code ) {
-    const char *s;
-    switch (code) {
-      case     CURLM_CALL_MULTI_PERFORM: s="CURLM_CALL_MULTI_PERFORM"; break;
-      case     CURLM_BAD_HANDLE:         s="CURLM_BAD_HANDLE";         break;
-      case     CURLM_BAD_EASY_HANDLE:    s="CURLM_BAD_EASY_HANDLE";    break;
-      case     CURLM_OUT_OF_MEMORY:      s="CURLM_OUT_OF_MEMORY";      break;
-      case     CURLM_INTERNAL_ERROR:     s="CURLM_INTERNAL_ERROR";     break;
-      case     CURLM_UNKNOWN_OPTION:     s="CURLM_UNKNOWN_OPTION";     break;
-      case     CURLM_LAST:               s="CURLM_LAST";               break;
-      default: s="CURLM_unknown";
-        break;
-    case     CURLM_BAD_SOCKET:         s="CURLM_BAD_SOCKET";
+  Watch *w = (Watch *)arg;
 
-      fprintf(MSG_OUT, "ERROR: %s returns %s\n", where, s);
-      /* ignore this error */
-      return;
-    }
-    fprintf(MSG_OUT, "ERROR: %s returns %s\n", where, s);
-    exit(code);
-  }
+  COUNT_ADD(w->loop->dispatched, 1);
+  w->cb(fd, (what & EV_READ ? WATCH_READ : 0) |
+            (what & EV_WRITE ? WATCH_WRITE : 0), w->arg);
 }
 
+static int lev_init(Loop *l, const LoopConfig *cfg)
+{
+  struct event_config *ecfg = event_config_new();
+  const char **methods = event_get_supported_methods();
+  char avoid[256];
+  char *tok, *save;
+  int i;
 
+  snprintf(avoid, sizeof(avoid), "%s", cfg->avoid ? cfg->avoid : "");
+  for (tok = strtok_r(avoid, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+    event_config_avoid_method(ecfg, tok);
+  for (i = 0; cfg->method && methods[i]; i++)
+    if (strcmp(methods[i], cfg->method))
+      event_config_avoid_method(ecfg, methods[i]);
+  if (cfg->edge)
+    event_config_require_features(ecfg, EV_FEATURE_ET);
+  event_config_set_flag(ecfg, EVENT_BASE_FLAG_PRECISE_TIMER |
+                        (cfg->changelist ?
+                         EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST : 0));
+  l->base = event_base_new_with_config(ecfg);
+  event_config_free(ecfg);
+  if (!l->base)
+    return -1;
+  l->method = event_base_get_method(l->base);
+  l->coalesces = cfg->changelist && !strncmp(l->method, "epoll", 5);
+  return 0;
+}
 
-/* Check for completed transfers, and remove their easy handles */
-static void check_multi_info(GlobalInfo *g)
+static void lev_done(Loop *l)
 {
-  char *eff_url;
-  CURLMsg *msg;
-  int msgs_left;
-  ConnInfo *conn;
-  CURL *easy;
-  CURLcode res;
+  event_base_free(l->base);
+}
 
-#ifdef DEBUG
-  fprintf(MSG_OUT, "REMAINING: %d\n", g->still_running);
-#endif
+static void lev_run(Loop *l)
+{
+  event_base_dispatch(l->base);
+}
 
-  while ((msg = curl_multi_info_read(g->multi, &msgs_left))) {
-    if (msg->msg == CURLMSG_DONE) {
-		// ------------------
-      easy = msg->easy_handle;
-      res = msg->data.result;
-      curl_easy_getinfo(easy, CURLINFO_PRIVATE, &conn);
-      curl_easy_getinfo(easy, CURLINFO_EFFECTIVE_URL, &eff_url);
-#ifdef DEBUG
-      fprintf(MSG_OUT, "DONE: %s => (%d) %s\n", eff_url, res, conn->error);
-#endif
-	  // -------------------
-	  //printf("len: %d = body: %s\n", conn->cont_len, conn->content);
+static void lev_stop(Loop *l)
+{
+  event_base_loopbreak(l->base);
+}
 
-#ifdef MYSQL_DB
-	  char sztt[32] = {'\0'};
-	  sprintf(sztt, "%d", conn->cont_len);
-	  
-	  static char query[MAX_WEBPAGE_SIZE], *end;
-		memset(query, '\0', MAX_WEBPAGE_SIZE);
-	  //end = strmov(query, "INSERT IGNORE INTO writers (name,size) VALUES(");
-		
-		end = strcpy(query, "INSERT IGNORE INTO writers (name,size) VALUES(");
-		end += strlen (end);
-	  *end++ = '\'';
-	  end += mysql_real_escape_string(g_pConn, end, (const char*)conn->content, conn->cont_len);
-	  *end++ = '\'';
-	  *end++ = ',';
-	  strncpy(end, sztt, strlen(sztt));
-	  end += strlen(sztt);
-	  *end++ = ')';
-	  //printf("sql: %s\n", query);	  
-
-	  if (mysql_real_query(g_pConn, query, (unsigned int) (end - query))) {
-		  fprintf(stderr, "Failed to insert row, Error: %s\n%s",
-			  mysql_error(g_pConn), query);
-		  fprintf(stderr,"-");
-	  } else {
-		fprintf(MSG_OUT,"+");
-	  }	  
-#else
-	  static char content[MAX_WEBPAGE_SIZE] = {'\0'};	  
-	  static char query[MAX_WEBPAGE_SIZE] = {'\0'};
-	  int flag = 0;
-
-	  memset(content, '\0', MAX_WEBPAGE_SIZE);	  
-	  memset(query, '\0', MAX_WEBPAGE_SIZE);
-
-	  int len = htonl(conn->cont_len);
-	  //set the values to use
-	  const char *values[2] = {conn->content, (char *)&len};
-	  //calculate the lengths of each of the values
-	  int lengths[2] = {len, sizeof(len)};
-	  //state which parameters are binary
-	  int binary[2] = {0, 1};
-
-	  PGresult *res = PQexecParams(g_pConn,
-		  "INSERT INTO writers (name,size) VALUES($1::text, $2::int)",
-		  //"SELECT person_id, name FROM person WHERE person_id != $1::int4 and name = $2::varchar",
-		  2, //number of parameters
-		  NULL, //ignore the Oid field
-		  values, //values to substitute $1 and $2
-		  lengths, //the lengths, in bytes, of each of the parameter values
-		  binary, //whether the values are binary or not
-		0); //we want the result in text format
-
-	  ExecStatusType st = PQresultStatus(res);
-	  //if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-	  if ( st != PGRES_COMMAND_OK) {	
-		  puts( PQresStatus(st) );
-		  puts( PQresultErrorMessage(res) );
-		  puts( "command error! insert" );			  
-		}
-/*
-	  size_t to_length = 0;
-	  unsigned char* tbuf = PQescapeByteaConn (g_pConn, (const unsigned char *)conn->content, 
-				conn->cont_len, &to_length);
-	  puts( (const char *)tbuf );
-	  PQfreemem (tbuf);
-
-///*
-	  int error = 0;
-	  size_t write_size = PQescapeStringConn (g_pConn, content, conn->content, 
-		  conn->cont_len, &error);
-
-	  if (error == 0)
-	  {
-		  content[write_size+1] = '\0';
-		  
-		  sprintf(query, "INSERT INTO writers (name,size) VALUES('%s',%d)",
-			  content, conn->cont_len);	  
-		  
-		  PGresult   *res;
-		  res = PQexec(g_pConn, query);
-		  ExecStatusType st = PQresultStatus(res);
-		  //if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-		  if ( st != PGRES_COMMAND_OK) {	
-			  puts( PQresStatus(st) );
-			  puts( PQresultErrorMessage(res) );
-			  puts( "command error! insert" );	
-			  puts( query );
-		  }
-
-		  flag = 1;	  	  
-	  } else {
-		  fprintf(stderr, "Failed iconv()!");	
-	  }	  
+static void lev_io_set(Watch *w, short kind)
+{
+  short flags = (kind & WATCH_READ ? EV_READ : 0) |
+                (kind & WATCH_WRITE ? EV_WRITE : 0) | EV_PERSIST |
+                (w->et && w->loop->edge ? EV_ET : 0);
 
-	  if (flag) {
-		fprintf(MSG_OUT,"+");
-	  } else {
-		fprintf(stderr,"-");
-	  }
-*/
-#endif
+  if (!w->ev)
+    w->ev = event_new(w->loop->base, w->fd, flags, lev_cb, w);
+  else {
+    event_del(w->ev);
+    event_assign(w->ev, w->loop->base, w->fd, flags, lev_cb, w);
+  }
+  if (kind)
+    event_add(w->ev, NULL);
+  w->kind = kind;
+}
 
-      curl_multi_remove_handle(g->multi, easy);
-      free(conn->url);
-      curl_easy_cleanup(easy);
-      free(conn);	  
+static void lev_timer_set(Watch *w, long ms)
+{
+  struct timeval tv;
 
-#ifdef DEBUG			
-			__sync_fetch_and_sub(&g_share_counter, 1);
-		fprintf(MSG_OUT, "free(conn) counter:%ld", g_share_counter);    
-#endif
-    }
+  if (!w->ev)
+    w->ev = evtimer_new(w->loop->base, lev_cb, w);
+  if (ms < 0) {
+    evtimer_del(w->ev);
+    return;
   }
+  tv.tv_sec = ms / 1000;
+  tv.tv_usec = (ms % 1000) * 1000;
+  evtimer_add(w->ev, &tv);
+}
+
+static void lev_watch_done(Watch *w)
+{
+  if (w->ev)
+    event_free(w->ev);
 }
 
+static const LoopOps lev_ops = {
+  "libevent", lev_init, lev_done, lev_run, lev_stop,
+  lev_io_set, lev_timer_set, lev_watch_done
+};
 
+/* libev; its EV_READ/EV_WRITE are hidden by libevent's macros */
 
-/* Called by libevent when we get action on a multi socket */
-static void event_cb(int fd, short kind, void *userp)
+#ifdef HAVE_LIBEV
+#define LIBEV_READ  0x01
+#define LIBEV_WRITE 0x02
+
+static void libev_io_cb(struct ev_loop *loop, ev_io *io, int revents)
 {
-  GlobalInfo *g = (GlobalInfo*) userp;
-  CURLMcode rc;
+  Watch *w = (Watch *)io->data;
+  (void)loop;
 
-  int action =
-    (kind & EV_READ ? CURL_CSELECT_IN : 0) |
-    (kind & EV_WRITE ? CURL_CSELECT_OUT : 0);
+  COUNT_ADD(w->loop->dispatched, 1);
+  w->cb(w->fd, (revents & LIBEV_READ ? WATCH_READ : 0) |
+               (revents & LIBEV_WRITE ? WATCH_WRITE : 0), w->arg);
+}
 
-  rc = curl_multi_socket_action(g->multi, fd, action, &g->still_running);
-  mcode_or_die("event_cb: curl_multi_socket_action", rc);
+static void libev_timer_cb(struct ev_loop *loop, ev_timer *tm, int revents)
+{
+  Watch *w = (Watch *)tm->data;
+  (void)loop;
+  (void)revents;
 
-  check_multi_info(g);
-  if ( g->still_running <= 0 ) {
-#ifdef DEBUG
-    fprintf(MSG_OUT, "last transfer done, kill timeout\n");
-#endif
-    if (evtimer_pending(g->timer_event, NULL)) {
-      evtimer_del(g->timer_event);
-    }
-  }
+  COUNT_ADD(w->loop->dispatched, 1);
+  w->cb(-1, 0, w->arg);
 }
 
+static unsigned int libev_method(const char *name)
+{
+  if (!strcmp(name, "epoll"))
+    return EVBACKEND_EPOLL;
+  if (!strcmp(name, "poll"))
+    return EVBACKEND_POLL;
+  if (!strcmp(name, "select"))
+    return EVBACKEND_SELECT;
+  return 0;
+}
 
+static int libev_init(Loop *l, const LoopConfig *cfg)
+{
+  unsigned int flags = ev_recommended_backends();
+  char avoid[256];
+  char *tok, *save;
 
-/* Called by libevent when our timeout expires */
-static void timer_cb(int fd, short kind, void *userp)
+  snprintf(avoid, sizeof(avoid), "%s", cfg->avoid ? cfg->avoid : "");
+  for (tok = strtok_r(avoid, ",", &save); tok; tok = strtok_r(NULL, ",", &save))
+    flags &= ~libev_method(tok);
+  if (cfg->method)
+    flags = libev_method(cfg->method);
+  if (!flags)
+    return -1;
+  l->ev = ev_loop_new(flags);
+  if (!l->ev)
+    return -1;
+  switch (ev_backend(l->ev)) {
+    case EVBACKEND_EPOLL:  l->method = "epoll";  break;
+    case EVBACKEND_POLL:   l->method = "poll";   break;
+    case EVBACKEND_SELECT: l->method = "select"; break;
+    default:               l->method = "other";  break;
+  }
+  l->edge = 0;  /* libev has no edge-triggered mode */
+  l->coalesces = 1;  /* fd changes are applied once per iteration */
+  return 0;
+}
+
+static void libev_done(Loop *l)
 {
-  GlobalInfo *g = (GlobalInfo *)userp;
-  CURLMcode rc;
-  (void)fd;
-  (void)kind;
+  ev_loop_destroy(l->ev);
+}
 
-  rc = curl_multi_socket_action(g->multi,
-                                  CURL_SOCKET_TIMEOUT, 0, &g->still_running);
-  mcode_or_die("timer_cb: curl_multi_socket_action", rc);
-  check_multi_info(g);
+static void libev_run(Loop *l)
+{
+  ev_run(l->ev, 0);
 }
 
+static void libev_stop(Loop *l)
+{
+  ev_break(l->ev, EVBREAK_ALL);
+}
 
+static void libev_watch_init(Watch *w)
+{
+  if (w->ev_init)
+    return;
+  ev_io_init(&w->io, libev_io_cb, w->fd, 0);
+  ev_timer_init(&w->tm, libev_timer_cb, 0., 0.);
+  w->io.data = w;
+  w->tm.data = w;
+  w->ev_init = 1;
+}
 
-/* Clean up the SockInfo structure */
-static void remsock(SockInfo *f)
+static void libev_io_set(Watch *w, short kind)
 {
-  if (f) {
-    if (f->evset)
-      event_free(f->ev);
-    free(f);
+  libev_watch_init(w);
+  ev_io_stop(w->loop->ev, &w->io);
+  if (kind) {
+    ev_io_set(&w->io, w->fd, (kind & WATCH_READ ? LIBEV_READ : 0) |
+                             (kind & WATCH_WRITE ? LIBEV_WRITE : 0));
+    ev_io_start(w->loop->ev, &w->io);
   }
+  w->kind = kind;
 }
 
+static void libev_timer_set(Watch *w, long ms)
+{
+  libev_watch_init(w);
+  ev_timer_stop(w->loop->ev, &w->tm);
+  if (ms < 0)
+    return;
+  ev_now_update(w->loop->ev);  /* ev_now() may be a whole callback late */
+  ev_timer_set(&w->tm, ms / 1000., 0.);
+  ev_timer_start(w->loop->ev, &w->tm);
+}
 
+static void libev_watch_done(Watch *w)
+{
+  if (!w->ev_init)
+    return;
+  ev_io_stop(w->loop->ev, &w->io);
+  ev_timer_stop(w->loop->ev, &w->tm);
+}
 
-/* Assign information to a SockInfo structure */
-static void setsock(SockInfo*f, curl_socket_t s, CURL*e, int act, GlobalInfo*g)
+static const LoopOps libev_ops = {
+  "libev", libev_init, libev_done, libev_run, libev_stop,
+  libev_io_set, libev_timer_set, libev_watch_done
+};
+#endif
+
+/* epoll, timers in a binary min-heap on their deadline */
+
+#define EPOLL_EVENTS 256
+
+static void heap_swap(Loop *l, int a, int b)
 {
-  int kind =
-     (act&CURL_POLL_IN?EV_READ:0)|(act&CURL_POLL_OUT?EV_WRITE:0)|EV_PERSIST;
+  Watch *t = l->heap[a];
 
-  f->sockfd = s;
-  f->action = act;
-  f->easy = e;
-  if (f->evset)
-    event_free(f->ev);
-  f->ev = event_new(g->evbase, f->sockfd, kind, event_cb, g);
-  f->evset = 1;
-  event_add(f->ev, NULL);
+  l->heap[a] = l->heap[b];
+  l->heap[b] = t;
+  l->heap[a]->heap_idx = a;
+  l->heap[b]->heap_idx = b;
+}
+
+static void heap_up(Loop *l, int i)
+{
+  while (i > 0 && l->heap[(i - 1) / 2]->deadline > l->heap[i]->deadline) {
+    heap_swap(l, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
 }
 
+static void heap_down(Loop *l, int i)
+{
+  for (;;) {
+    int c = 2 * i + 1;
 
+    if (c >= l->heap_len)
+      break;
+    if (c + 1 < l->heap_len && l->heap[c + 1]->deadline < l->heap[c]->deadline)
+      c++;
+    if (l->heap[i]->deadline <= l->heap[c]->deadline)
+      break;
+    heap_swap(l, i, c);
+    i = c;
+  }
+}
 
-/* Initialize a new SockInfo structure */
-static void addsock(curl_socket_t s, CURL *easy, int action, GlobalInfo *g)
+static void heap_remove(Loop *l, Watch *w)
 {
-  SockInfo *fdp = (SockInfo *)calloc(sizeof(SockInfo), 1);
+  int i = w->heap_idx;
 
-  fdp->global = g;
-  setsock(fdp, s, easy, action, g);
-  curl_multi_assign(g->multi, s, fdp);
+  if (i < 0)
+    return;
+  w->heap_idx = -1;
+  if (i != --l->heap_len) {
+    l->heap[i] = l->heap[l->heap_len];
+    l->heap[i]->heap_idx = i;
+    heap_down(l, i);
+    heap_up(l, i);
+  }
 }
 
-/* CURLMOPT_SOCKETFUNCTION */
-static int sock_cb(CURL *e, curl_socket_t s, int what, void *cbp, void *sockp)
+static int epl_init(Loop *l, const LoopConfig *cfg)
 {
-  GlobalInfo *g = (GlobalInfo*) cbp;
-  SockInfo *fdp = (SockInfo*) sockp;
+  (void)cfg;
+  l->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (l->epfd == -1)
+    return -1;
+  l->ready = (struct epoll_event *)malloc(EPOLL_EVENTS *
+                                          sizeof(struct epoll_event));
+  l->method = "epoll";
+  l->coalesces = 1;
+  return 0;
+}
 
-#ifdef DEBUG
-  const char *whatstr[]={ "none", "IN", "OUT", "INOUT", "REMOVE" };
-  fprintf(MSG_OUT,
-          "socket callback: s=%d e=%p what=%s ", s, e, whatstr[what]);
-#endif
+static void epl_done(Loop *l)
+{
+  close(l->epfd);
+  free(l->ready);
+  free(l->heap);
+}
 
-  if (what == CURL_POLL_REMOVE) {
-#ifdef DEBUG
-    fprintf(MSG_OUT, "\n");
-#endif
-    remsock(fdp);
-  }
-  else {
-    if (!fdp) {
-#ifdef DEBUG
-      fprintf(MSG_OUT, "Adding data: %s\n", whatstr[what]);
-#endif
-      addsock(s, e, what, g);
+static void epl_run(Loop *l)
+{
+  l->stopping = 0;
+  while (!l->stopping) {
+    long long now;
+    int timeout = -1;
+    int i;
+
+    if (l->heap_len) {
+      long long left = l->heap[0]->deadline - now_ms();
+      timeout = left > 0 ? (int)left : 0;
     }
-    else {
-#ifdef DEBUG
-      fprintf(MSG_OUT,
-              "Changing action from %s to %s\n",
-              whatstr[fdp->action], whatstr[what]);
-#endif
-      setsock(fdp, s, e, what, g);
+    l->nready = epoll_wait(l->epfd, l->ready, EPOLL_EVENTS, timeout);
+    if (l->nready == -1) {
+      if (errno != EINTR)
+        perror("epoll_wait");
+      l->nready = 0;
+    }
+    for (i = 0; i < l->nready; i++) {
+      Watch *w = (Watch *)l->ready[i].data.ptr;
+      uint32_t e = l->ready[i].events;
+
+      if (!w)  /* freed by an earlier callback of this round */
+        continue;
+      COUNT_ADD(l->dispatched, 1);
+      w->cb(w->fd, (e & (EPOLLIN | EPOLLHUP | EPOLLERR) ? WATCH_READ : 0) |
+                   (e & (EPOLLOUT | EPOLLHUP | EPOLLERR) ? WATCH_WRITE : 0),
+            w->arg);
+    }
+    l->nready = 0;
+
+    now = now_ms();
+    while (l->heap_len && l->heap[0]->deadline <= now) {
+      Watch *w = l->heap[0];
+
+      heap_remove(l, w);
+      COUNT_ADD(l->dispatched, 1);
+      w->cb(-1, 0, w->arg);
     }
   }
-  return 0;
 }
 
+static void epl_stop(Loop *l)
+{
+  l->stopping = 1;
+}
 
+/* Drop events of w still waiting in this round */
+static void epl_forget(Watch *w)
+{
+  Loop *l = w->loop;
+  int i;
 
-/* CURLOPT_WRITEFUNCTION */
-static size_t write_cb(void *ptr, size_t size, size_t nmemb, void *data)
+  for (i = 0; i < l->nready; i++)
+    if (l->ready[i].data.ptr == w)
+      l->ready[i].data.ptr = NULL;
+}
+
+static void epl_io_set(Watch *w, short kind)
 {
-  size_t realsize = size * nmemb;
-  ConnInfo *conn = (ConnInfo*) data;
-  (void)ptr;
-  (void)conn;
+  struct epoll_event e;
+  int op;
 
-  //CURLcode res;
-  //double filesize;
-  //time_t filetime;
- /* res = curl_easy_getinfo(conn->easy, CURLINFO_FILETIME, &filetime);
-  if((CURLE_OK == res) && filetime)
-        printf("filetime %s", ctime(&filetime));
-*/
-  /*res = curl_easy_getinfo(conn->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &filesize);
-  if((CURLE_OK == res) && filesize)
-        printf("filesize: %0.0f bytes\n", filesize);
-	*/
+  if (kind == w->kind)
+    return;
+  e.events = 0;
+  if (kind & WATCH_READ)
+    e.events |= EPOLLIN;
+  if (kind & WATCH_WRITE)
+    e.events |= EPOLLOUT;
+  if (w->et && w->loop->edge)
+    e.events |= EPOLLET;
+  e.data.ptr = w;
+  op = !w->kind ? EPOLL_CTL_ADD : kind ? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
+  if (epoll_ctl(w->loop->epfd, op, w->fd, &e) == -1 && op != EPOLL_CTL_DEL)
+    perror("epoll_ctl");
+  if (!kind)
+    epl_forget(w);  /* it may be re-used for another fd right away */
+  w->kind = kind;
+}
 
-  // ------------------
-  //printf("len: %d body: %s\n", conn->cont_len, conn->content);  
-  memcpy(conn->content + conn->cont_len, ptr, realsize);  
-  conn->cont_len += realsize;
-  //printf("len: %d body: %s\n", conn->cont_len, conn->content);  
-  return realsize;
-  /*
-  // ------------------
-  char substr[102400] = {'\0'};
-  strncpy(substr, (const char*)ptr, realsize);
+static void epl_timer_set(Watch *w, long ms)
+{
+  Loop *l = w->loop;
+
+  heap_remove(l, w);
+  if (ms < 0)
+    return;
+  if (l->heap_len == l->heap_size) {
+    l->heap_size = l->heap_size ? l->heap_size * 2 : 64;
+    l->heap = (Watch **)realloc(l->heap, l->heap_size * sizeof(Watch *));
+    if (l->heap == NULL) {
+      fprintf(MSG_OUT, "realloc failed!\n");
+      exit (1);
+    }
+  }
+  w->deadline = now_ms() + ms;
+  w->heap_idx = l->heap_len++;
+  l->heap[w->heap_idx] = w;
+  heap_up(l, w->heap_idx);
+}
+
+static void epl_watch_done(Watch *w)
+{
+  if (w->kind && w->fd >= 0)
+    epoll_ctl(w->loop->epfd, EPOLL_CTL_DEL, w->fd, NULL);
+  epl_forget(w);
+  heap_remove(w->loop, w);
+}
+
+static const LoopOps epl_ops = {
+  "epoll", epl_init, epl_done, epl_run, epl_stop,
+  epl_io_set, epl_timer_set, epl_watch_done
+};
+
+static const LoopOps *loop_backends[] = {
+  &lev_ops,
+#ifdef HAVE_LIBEV
+  &libev_ops,
+#endif
+  &epl_ops,
+  NULL
+};
+
+static Loop *loop_new(const LoopConfig *cfg)
+{
+  Loop *l = (Loop *)calloc(1, sizeof(Loop));
+  int i;
+
+  for (i = 0; loop_backends[i]; i++)
+    if (!strcmp(loop_backends[i]->name, cfg->backend))
+      l->ops = loop_backends[i];
+  if (!l->ops) {
+    fprintf(MSG_OUT, "unknown event loop backend \"%s\"\n", cfg->backend);
+    exit (1);
+  }
+  l->edge = cfg->edge;
+  if (l->ops->init(l, cfg)) {
+    fprintf(MSG_OUT, "%s: no usable method\n", cfg->backend);
+    exit (1);
+  }
+  return l;
+}
+
+static void loop_free(Loop *l)
+{
+  l->ops->done(l);
+  free(l);
+}
+
+static Watch *watch_new(Loop *l, int fd, watch_cb cb, void *arg)
+{
+  Watch *w = (Watch *)calloc(1, sizeof(Watch));
+
+  if (w == NULL) {
+    fprintf(MSG_OUT, "calloc failed!\n");
+    exit (1);
+  }
+  w->loop = l;
+  w->fd = fd;
+  w->cb = cb;
+  w->arg = arg;
+  w->heap_idx = -1;
+  return w;
+}
+
+static void watch_io(Watch *w, short kind)
+{
+  w->loop->ops->io_set(w, kind);
+}
+
+static void watch_timer(Watch *w, long ms)
+{
+  w->loop->ops->timer_set(w, ms);
+}
+
+static void watch_free(Watch *w)
+{
+  if (w) {
+    w->loop->ops->watch_done(w);
+    free(w);
+  }
+}
+
+/* -B: pass tokens around a ring of pipes through every backend, with a
+   timer re-armed alongside, and compare with the same reads and writes
+   done without a loop */
+#define BENCH_PIPES 64
+#define BENCH_TOKENS 16
+#define BENCH_HOPS 1000000
+
+typedef struct _Bench
+{
+  Loop *loop;
+  int fds[BENCH_PIPES][2];
+  Watch *w[BENCH_PIPES];
+  int idx[BENCH_PIPES];
+  long hops;
+  Watch *timer;
+  long long due_us;
+  long long late_us;
+  long long late_max_us;
+  long timers;
+} Bench;
+
+static Bench bench;
+
+static void bench_io_cb(int fd, short kind, void *arg)
+{
+  int i = *(int *)arg;
+  char buf[BENCH_TOKENS];
+  ssize_t n = read(fd, buf, sizeof(buf));  /* all of it, for -e */
+  (void)kind;
+
+  if (n <= 0)
+    return;
+  bench.hops += n;
+  if (bench.hops >= BENCH_HOPS)
+    bench.loop->ops->stop(bench.loop);
+  else if (write(bench.fds[(i + 1) % BENCH_PIPES][1], buf, n) != n)
+    perror("write(bench)");
+}
+
+static void bench_timer_cb(int fd, short kind, void *arg)
+{
+  long long late = now_us() - bench.due_us;
+  long ms = 1 + bench.timers % 5;
+  (void)fd;
+  (void)kind;
+  (void)arg;
+
+  bench.late_us += late;
+  if (late > bench.late_max_us)
+    bench.late_max_us = late;
+  bench.timers++;
+  bench.due_us = now_us() + ms * 1000;
+  watch_timer(bench.timer, ms);
+}
+
+static void loop_bench(const LoopConfig *cfg)
+{
+  LoopConfig c = *cfg;
+  long long t0, base_ns;
+  char tok[BENCH_TOKENS];
+  long hops;
+  int i, b;
+
+  memset(tok, 'x', sizeof(tok));
+  for (i = 0; i < BENCH_PIPES; i++)
+    if (pipe2(bench.fds[i], O_NONBLOCK)) {
+      perror("pipe2");
+      exit (1);
+    }
+
+  /* the syscalls alone */
+  t0 = now_us();
+  for (hops = 0; hops < BENCH_HOPS; hops++) {
+    char ch;
+    if (write(bench.fds[hops % BENCH_PIPES][1], "x", 1) != 1 ||
+        read(bench.fds[hops % BENCH_PIPES][0], &ch, 1) != 1)
+      perror("bench");
+  }
+  base_ns = (now_us() - t0) * 1000 / BENCH_HOPS;
+  fprintf(MSG_OUT, "bench: %d hops over %d pipes, %d tokens, "
+          "read+write alone %lld ns/hop\n",
+          BENCH_HOPS, BENCH_PIPES, BENCH_TOKENS, base_ns);
+
+  for (b = 0; loop_backends[b]; b++) {
+    long long ns;
+
+    c.backend = loop_backends[b]->name;
+    bench.loop = loop_new(&c);
+    bench.hops = bench.timers = 0;
+    bench.late_us = bench.late_max_us = 0;
+    for (i = 0; i < BENCH_PIPES; i++) {
+      bench.idx[i] = i;
+      bench.w[i] = watch_new(bench.loop, bench.fds[i][0], bench_io_cb,
+                             &bench.idx[i]);
+      bench.w[i]->et = 1;
+      watch_io(bench.w[i], WATCH_READ);
+    }
+    bench.timer = watch_new(bench.loop, -1, bench_timer_cb, NULL);
+    bench.due_us = now_us() + 1000;
+    watch_timer(bench.timer, 1);
+    for (i = 0; i < BENCH_TOKENS; i++)
+      if (write(bench.fds[i * BENCH_PIPES / BENCH_TOKENS][1], tok, 1) != 1)
+        perror("write(bench)");
+
+    t0 = now_us();
+    bench.loop->ops->run(bench.loop);
+    ns = (now_us() - t0) * 1000 / bench.hops;
+
+    fprintf(MSG_OUT, "%s/%s%s: %ld callbacks, %lld ns/hop, "
+            "loop overhead %lld ns/hop; timers %ld, late avg %.3f ms "
+            "max %.3f ms\n", c.backend, bench.loop->method,
+            bench.loop->edge ? " (edge)" : "", bench.loop->dispatched, ns,
+            ns - base_ns, bench.timers,
+            bench.timers ? bench.late_us / 1000.0 / bench.timers : 0.0,
+            bench.late_max_us / 1000.0);
+
+    for (i = 0; i < BENCH_PIPES; i++) {
+      watch_free(bench.w[i]);
+      while (read(bench.fds[i][0], tok, sizeof(tok)) > 0)
+        ;
+    }
+    watch_free(bench.timer);
+    loop_free(bench.loop);
+  }
+}
+
+/* --------------------------------
+   XXH64
+
+   Bodies are hashed as they arrive, so a duplicate is known without
+   another pass over the page. Little-endian reads, as on x86. */
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3  1609587929392839161ULL
+#define XXH_P4  9650029242287828579ULL
+#define XXH_P5  2870177450012600261ULL
+
+typedef struct _Xxh64
+{
+  uint64_t v[4];
+  uint64_t total;
+  unsigned char mem[32];
+  unsigned int memsize;
+} Xxh64;
+
+static inline uint64_t xxh_rotl(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t in)
+{
+  acc += in * XXH_P2;
+  return xxh_rotl(acc, 31) * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t h, uint64_t v)
+{
+  h ^= xxh_round(0, v);
+  return h * XXH_P1 + XXH_P4;
+}
+
+static inline uint64_t xxh_read64(const unsigned char *p)
+{
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+static void xxh64_reset(Xxh64 *s, uint64_t seed)
+{
+  s->v[0] = seed + XXH_P1 + XXH_P2;
+  s->v[1] = seed + XXH_P2;
+  s->v[2] = seed;
+  s->v[3] = seed - XXH_P1;
+  s->total = 0;
+  s->memsize = 0;
+}
+
+static void xxh64_stripe(Xxh64 *s, const unsigned char *p)
+{
+  s->v[0] = xxh_round(s->v[0], xxh_read64(p));
+  s->v[1] = xxh_round(s->v[1], xxh_read64(p + 8));
+  s->v[2] = xxh_round(s->v[2], xxh_read64(p + 16));
+  s->v[3] = xxh_round(s->v[3], xxh_read64(p + 24));
+}
+
+static void xxh64_update(Xxh64 *s, const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)data;
+
+  s->total += len;
+  if (s->memsize + len < 32) {
+    memcpy(s->mem + s->memsize, p, len);
+    s->memsize += len;
+    return;
+  }
+  if (s->memsize) {
+    size_t fill = 32 - s->memsize;
+    memcpy(s->mem + s->memsize, p, fill);
+    xxh64_stripe(s, s->mem);
+    p += fill;
+    len -= fill;
+    s->memsize = 0;
+  }
+  for (; len >= 32; p += 32, len -= 32)
+    xxh64_stripe(s, p);
+  memcpy(s->mem, p, len);
+  s->memsize = len;
+}
+
+static uint64_t xxh64_digest(const Xxh64 *s)
+{
+  const unsigned char *p = s->mem;
+  unsigned int left = s->memsize;
+  uint64_t h;
+
+  if (s->total >= 32) {
+    h = xxh_rotl(s->v[0], 1) + xxh_rotl(s->v[1], 7) +
+        xxh_rotl(s->v[2], 12) + xxh_rotl(s->v[3], 18);
+    h = xxh_merge(h, s->v[0]);
+    h = xxh_merge(h, s->v[1]);
+    h = xxh_merge(h, s->v[2]);
+    h = xxh_merge(h, s->v[3]);
+  } else {
+    h = s->v[2] + XXH_P5;  /* the seed */
+  }
+  h += s->total;
+  for (; left >= 8; p += 8, left -= 8) {
+    h ^= xxh_round(0, xxh_read64(p));
+    h = xxh_rotl(h, 27) * XXH_P1 + XXH_P4;
+  }
+  if (left >= 4) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    h ^= (uint64_t)v * XXH_P1;
+    h = xxh_rotl(h, 23) * XXH_P2 + XXH_P3;
+    p += 4;
+    left -= 4;
+  }
+  for (; left; p++, left--) {
+    h ^= *p * XXH_P5;
+    h = xxh_rotl(h, 11) * XXH_P1;
+  }
+  h ^= h >> 33;
+  h *= XXH_P2;
+  h ^= h >> 29;
+  h *= XXH_P3;
+  h ^= h >> 32;
+  return h;
+}
+
+static uint64_t xxh64(const void *data, size_t len, uint64_t seed)
+{
+  Xxh64 s;
+
+  xxh64_reset(&s, seed);
+  xxh64_update(&s, data, len);
+  return xxh64_digest(&s);
+}
+
+/* --------------------------------
+   Seen-URL filter
+
+   A cuckoo filter over the URLs fetched, so a list piped in again doesn't
+   refetch what was fetched within SEEN_TTL_MINUTES. A URL goes in when it
+   completes with a 2xx or 304, not when it is read, so failures can be
+   piped in again at once; one given up on is taken out. From the read to
+   its last try a URL is held in a small in-memory set instead, so a copy
+   piped in meanwhile isn't fetched a second time; that set dies with the
+   process. Urgent URLs bypass both. A slot is 32
+   bits: a 16 bit fingerprint over the minute it was fetched, modulo
+   2^16. Slots older than the TTL count as free, so the filter never needs
+   a sweep; an entry left untouched for 45 days may look fresh again. The
+   table is a shared mapping of SEEN_FILE and survives restarts without a
+   load pass. A false positive, about 8 in 65536 when full, skips a URL
+   that wasn't fetched. The reader checks and every shard marks, under
+   one lock. Keep the TTL below the re-crawl interval of pages meant to
+   be re-checked with their validators. */
+
+#define SEEN_MAGIC 0x6e656573u  /* "seen" */
+#define SEEN_SLOTS 4            /* per bucket */
+#define SEEN_MAX_KICKS 500
+#define SEEN_HEADER 64          /* bytes before the table */
+
+typedef struct _SeenHeader
+{
+  uint32_t magic;
+  uint32_t slots;
+  uint64_t buckets;
+} SeenHeader;
+
+typedef struct _SeenFilter
+{
+  int fd;
+  void *map;
+  size_t map_size;
+  uint32_t *table;            /* buckets * SEEN_SLOTS */
+  size_t mask;
+  pthread_mutex_t lock;       /* the reader checks, every shard marks */
+  unsigned int victim;        /* rotates the slot kicked out */
+  uint64_t *busy;             /* XXH64 of URLs being fetched, 0 is empty */
+  size_t busy_mask;
+  size_t busy_count;
+  long checked;
+  long skipped;               /* fetches avoided */
+  long overflows;             /* entries lost after SEEN_MAX_KICKS */
+} SeenFilter;
+
+static inline size_t seen_alt(SeenFilter *sf, size_t i, uint32_t fp)
+{
+  return (i ^ (fp * 0x5bd1e995u)) & sf->mask;
+}
+
+static inline uint32_t seen_fp(uint64_t h)
+{
+  uint32_t fp = (uint32_t)(h >> 48);
+
+  return fp ? fp : 1;
+}
+
+static inline int seen_fresh(uint32_t slot, unsigned int minute)
+{
+  return slot && ((minute - slot) & 0xffff) < SEEN_TTL_MINUTES;
+}
+
+/* The fresh slot holding the URL's fingerprint, or NULL */
+static uint32_t *seen_find(SeenFilter *sf, uint64_t h, unsigned int minute)
+{
+  uint32_t fp = seen_fp(h), *b1, *b2;
+  int s;
+
+  b1 = sf->table + (h & sf->mask) * SEEN_SLOTS;
+  b2 = sf->table + seen_alt(sf, h & sf->mask, fp) * SEEN_SLOTS;
+  for (s = 0; s < SEEN_SLOTS; s++) {
+    if ((b1[s] >> 16) == fp && seen_fresh(b1[s], minute))
+      return &b1[s];
+    if ((b2[s] >> 16) == fp && seen_fresh(b2[s], minute))
+      return &b2[s];
+  }
+  return NULL;
+}
+
+/* The busy slot of h, or of the hole where it would go */
+static size_t seen_busy_slot(SeenFilter *sf, uint64_t h)
+{
+  size_t i;
+
+  for (i = h & sf->busy_mask; sf->busy[i] && sf->busy[i] != h;
+       i = (i + 1) & sf->busy_mask)
+    ;
+  return i;
+}
+
+static void seen_busy_add(SeenFilter *sf, uint64_t h)
+{
+  size_t i;
+
+  if ((sf->busy_count + 1) * 4 > (sf->busy_mask + 1) * 3) {
+    uint64_t *old = sf->busy;
+    size_t n = sf->busy_mask + 1;
+
+    sf->busy_mask = n * 2 - 1;
+    sf->busy = (uint64_t *)calloc(n * 2, sizeof(uint64_t));
+    if (sf->busy == NULL) {
+      fprintf(MSG_OUT, "calloc failed!\n");
+      exit (1);
+    }
+    for (i = 0; i < n; i++)
+      if (old[i])
+        sf->busy[seen_busy_slot(sf, old[i])] = old[i];
+    free(old);
+  }
+  i = seen_busy_slot(sf, h);
+  if (!sf->busy[i]) {
+    sf->busy[i] = h;
+    sf->busy_count++;
+  }
+}
+
+/* Take h out of the busy set, shifting later entries of its run back */
+static void seen_busy_del(SeenFilter *sf, uint64_t h)
+{
+  size_t i = seen_busy_slot(sf, h), j, home;
+
+  if (!sf->busy[i])
+    return;
+  sf->busy_count--;
+  for (j = i;;) {
+    sf->busy[i] = 0;
+    for (;;) {
+      j = (j + 1) & sf->busy_mask;
+      if (!sf->busy[j])
+        return;
+      home = sf->busy[j] & sf->busy_mask;
+      if (i <= j ? (home <= i || home > j) : (home <= i && home > j))
+        break;
+    }
+    sf->busy[i] = sf->busy[j];
+    i = j;
+  }
+}
+
+/* The URL's key in the busy set */
+static inline uint64_t seen_busy_key(const char *url, size_t len)
+{
+  uint64_t h = xxh64(url, len, 0);
+
+  return h ? h : 1;
+}
+
+/* Returns 1 if the URL was fetched within the TTL or is being fetched;
+   otherwise it counts as being fetched from now on, until seen_mark(),
+   seen_forget() or seen_release() */
+static int seen_check(SeenFilter *sf, const char *url, size_t len,
+                      unsigned int minute)
+{
+  uint64_t h = seen_busy_key(url, len);
+  int hit;
+
+  pthread_mutex_lock(&sf->lock);
+  COUNT_ADD(sf->checked, 1);  /* under the lock, read by the stats */
+  hit = seen_find(sf, h, minute & 0xffff) != NULL ||
+        sf->busy[seen_busy_slot(sf, h)];
+  if (!hit)
+    seen_busy_add(sf, h);
+  COUNT_ADD(sf->skipped, hit);
+  pthread_mutex_unlock(&sf->lock);
+  return hit;
+}
+
+/* The URL's last try ended without a page worth remembering */
+static void seen_release(SeenFilter *sf, const char *url)
+{
+  uint64_t h = seen_busy_key(url, strlen(url));
+
+  pthread_mutex_lock(&sf->lock);
+  seen_busy_del(sf, h);
+  pthread_mutex_unlock(&sf->lock);
+}
+
+/* Record a URL fetched at minute */
+static void seen_mark(SeenFilter *sf, const char *url, unsigned int minute)
+{
+  uint64_t h = seen_busy_key(url, strlen(url));
+  uint32_t fp = seen_fp(h), entry, kicked, *b1, *b2, *b;
+  size_t i;
+  int s, k;
+
+  minute &= 0xffff;
+  entry = fp << 16 | minute;
+  pthread_mutex_lock(&sf->lock);
+  seen_busy_del(sf, h);
+  if ((b = seen_find(sf, h, minute))) {
+    *b = entry;  /* fetched again: the TTL starts over */
+    goto done;
+  }
+  b1 = sf->table + (h & sf->mask) * SEEN_SLOTS;
+  b2 = sf->table + seen_alt(sf, h & sf->mask, fp) * SEEN_SLOTS;
+  for (s = 0; s < SEEN_SLOTS; s++)
+    if (!seen_fresh(b1[s], minute)) {
+      b1[s] = entry;
+      goto done;
+    }
+  for (s = 0; s < SEEN_SLOTS; s++)
+    if (!seen_fresh(b2[s], minute)) {
+      b2[s] = entry;
+      goto done;
+    }
+
+  /* both buckets full: move residents to their other bucket */
+  i = (b2 - sf->table) / SEEN_SLOTS;
+  for (k = 0; k < SEEN_MAX_KICKS; k++) {
+    b = sf->table + i * SEEN_SLOTS;
+    s = sf->victim++ % SEEN_SLOTS;
+    kicked = b[s];
+    b[s] = entry;
+    entry = kicked;
+    i = seen_alt(sf, i, entry >> 16);
+    b = sf->table + i * SEEN_SLOTS;
+    for (s = 0; s < SEEN_SLOTS; s++)
+      if (!seen_fresh(b[s], minute)) {
+        b[s] = entry;
+        goto done;
+      }
+  }
+  COUNT_ADD(sf->overflows, 1);  /* the last one kicked out is forgotten */
+done:
+  pthread_mutex_unlock(&sf->lock);
+}
+
+/* Drop a URL, so it is fetched the next time it is read */
+static void seen_forget(SeenFilter *sf, const char *url, unsigned int minute)
+{
+  uint64_t h = seen_busy_key(url, strlen(url));
+  uint32_t *slot;
+
+  pthread_mutex_lock(&sf->lock);
+  seen_busy_del(sf, h);
+  if ((slot = seen_find(sf, h, minute & 0xffff)))
+    *slot = 0;
+  pthread_mutex_unlock(&sf->lock);
+}
+
+/* Map SEEN_FILE, starting over if it was made with another geometry */
+static SeenFilter *seen_open(const char *path)
+{
+  SeenFilter *sf;
+  SeenHeader *hd;
+  struct stat st;
+  size_t size = SEEN_HEADER + (size_t)SEEN_BUCKETS * SEEN_SLOTS * 4;
+  int fresh;
+
+  if (SEEN_TTL_MINUTES <= 0)
+    return NULL;
+  sf = (SeenFilter *)calloc(1, sizeof(SeenFilter));
+  if (sf == NULL) {
+    fprintf(MSG_OUT, "calloc failed!\n");
+    exit (1);
+  }
+  sf->fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (sf->fd == -1 || fstat(sf->fd, &st) == -1) {
+    perror("open(seen)");
+    goto fail;
+  }
+  fresh = (size_t)st.st_size != size;
+  if (fresh && (ftruncate(sf->fd, 0) == -1 || ftruncate(sf->fd, size) == -1)) {
+    perror("ftruncate(seen)");
+    goto fail;
+  }
+  sf->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, sf->fd, 0);
+  if (sf->map == MAP_FAILED) {
+    perror("mmap(seen)");
+    goto fail;
+  }
+  sf->map_size = size;
+  hd = (SeenHeader *)sf->map;
+  if (hd->magic != SEEN_MAGIC || hd->slots != SEEN_SLOTS ||
+      hd->buckets != SEEN_BUCKETS) {
+    if (!fresh)  /* a new file is all zeros, keep it sparse */
+      memset(sf->map, 0, size);
+    hd->slots = SEEN_SLOTS;
+    hd->buckets = SEEN_BUCKETS;
+    hd->magic = SEEN_MAGIC;
+  }
+  sf->table = (uint32_t *)((char *)sf->map + SEEN_HEADER);
+  sf->mask = SEEN_BUCKETS - 1;
+  sf->busy_mask = 1023;
+  sf->busy = (uint64_t *)calloc(sf->busy_mask + 1, sizeof(uint64_t));
+  if (sf->busy == NULL) {
+    fprintf(MSG_OUT, "calloc failed!\n");
+    exit (1);
+  }
+  pthread_mutex_init(&sf->lock, NULL);
+  return sf;
+
+fail:
+  if (sf->fd != -1)
+    close(sf->fd);
+  free(sf);
+  return NULL;
+}
+
+static void seen_close(SeenFilter *sf)
+{
+  if (sf == NULL)
+    return;
+  munmap(sf->map, sf->map_size);  /* dirty pages still reach the file */
+  close(sf->fd);
+  free(sf->busy);
+  pthread_mutex_destroy(&sf->lock);
+  free(sf);
+}
+
+/* --------------------------------
+   Validators
+
+   ETag and Last-Modified of the pages fetched, keyed by the XXH64 of the
+   URL, so the next fetch of a page can be conditional and a 304 costs
+   neither the body nor a row. Striped like the digest index. Changes are
+   appended to VALIDATOR_FILE, which is replayed at start and rewritten
+   when most of it is stale. */
+
+#define VALIDATOR_STRIPES 64
+#define VALIDATOR_ETAG_MAX 128  /* longer ETags aren't kept */
+
+typedef struct _Validator
+{
+  uint64_t key;               /* 0 is empty; a zero key is stored as 1 */
+  long long last_modified;    /* 0 if none */
+  unsigned long size;         /* body bytes of the last full fetch */
+  char *etag;                 /* NULL if none */
+} Validator;
+
+typedef struct _ValidatorStripe
+{
+  pthread_mutex_t lock;
+  Validator *slots;
+  size_t mask;
+  size_t count;
+  char pad[64];
+} ValidatorStripe;
+
+typedef struct _ValidatorStore
+{
+  ValidatorStripe stripes[VALIDATOR_STRIPES];
+  int fd;                     /* VALIDATOR_FILE, append only */
+  long loaded;
+} ValidatorStore;
+
+/* VALIDATOR_FILE record, followed by etag_len bytes */
+typedef struct _ValidatorRecord
+{
+  uint64_t key;
+  int64_t last_modified;
+  uint32_t size;
+  uint32_t etag_len;
+} ValidatorRecord;
+
+static uint64_t validator_key(const char *url)
+{
+  uint64_t key = xxh64(url, strlen(url), 0);
+  return key ? key : 1;
+}
+
+/* Find key, or with add claim a slot for it */
+static Validator *validator_slot(ValidatorStripe *st, uint64_t key, int add)
+{
+  size_t i;
+
+  if (add && (st->count + 1) * 4 > (st->mask + 1) * 3) {
+    size_t n = (st->mask + 1) * 2, j;
+    Validator *slots = (Validator *)calloc(n, sizeof(Validator));
+
+    if (slots == NULL) {
+      fprintf(MSG_OUT, "calloc failed!\n");
+      exit (1);
+    }
+    for (j = 0; j <= st->mask; j++)
+      if (st->slots[j].key) {
+        for (i = (st->slots[j].key >> 6) & (n - 1); slots[i].key;
+             i = (i + 1) & (n - 1))
+          ;
+        slots[i] = st->slots[j];
+      }
+    free(st->slots);
+    st->slots = slots;
+    st->mask = n - 1;
+  }
+  for (i = (key >> 6) & st->mask; st->slots[i].key; i = (i + 1) & st->mask)
+    if (st->slots[i].key == key)
+      return &st->slots[i];
+  if (!add)
+    return NULL;
+  st->slots[i].key = key;
+  COUNT_ADD(st->count, 1);  /* under the lock, read by the stats */
+  return &st->slots[i];
+}
+
+/* Returns 1 if v changed */
+static int validator_set(Validator *v, const char *etag, long long lm,
+                         unsigned long size)
+{
+  if (etag && !*etag)
+    etag = NULL;
+  if (v->last_modified == lm && v->size == size &&
+      (etag ? v->etag && !strcmp(v->etag, etag) : !v->etag))
+    return 0;
+  free(v->etag);
+  v->etag = etag ? strdup(etag) : NULL;
+  v->last_modified = lm;
+  v->size = size;
+  return 1;
+}
+
+static int validator_write(int fd, const Validator *v)
+{
+  ValidatorRecord rec;
+  struct iovec iov[2];
+
+  rec.key = v->key;
+  rec.last_modified = v->last_modified;
+  rec.size = (uint32_t)v->size;
+  rec.etag_len = v->etag ? strlen(v->etag) : 0;
+  iov[0].iov_base = &rec;
+  iov[0].iov_len = sizeof(rec);
+  iov[1].iov_base = v->etag;
+  iov[1].iov_len = rec.etag_len;
+  return writev(fd, iov, 2) == (ssize_t)(sizeof(rec) + rec.etag_len);
+}
+
+/* Write the live entries to a new file and swap it in */
+static void validators_compact(ValidatorStore *vs, const char *path)
+{
+  char tmp[256];
+  size_t j;
+  int i, fd, ok = 1;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if (fd == -1) {
+    perror("open(validators)");
+    return;
+  }
+  for (i = 0; i < VALIDATOR_STRIPES && ok; i++)
+    for (j = 0; j <= vs->stripes[i].mask && ok; j++) {
+      Validator *v = &vs->stripes[i].slots[j];
+      if (v->key && (v->etag || v->last_modified))
+        ok = validator_write(fd, v);
+    }
+  if (!ok || rename(tmp, path) == -1) {
+    perror("write(validators)");
+    close(fd);
+    unlink(tmp);
+    return;
+  }
+  close(vs->fd);
+  vs->fd = fd;
+}
+
+static ValidatorStore *validators_open(const char *path)
+{
+  ValidatorStore *vs = (ValidatorStore *)calloc(1, sizeof(ValidatorStore));
+  ValidatorRecord rec;
+  char etag[VALIDATOR_ETAG_MAX];
+  long records = 0;
+  FILE *in;
+  int i;
+
+  if (vs == NULL) {
+    fprintf(MSG_OUT, "calloc failed!\n");
+    exit (1);
+  }
+  for (i = 0; i < VALIDATOR_STRIPES; i++) {
+    pthread_mutex_init(&vs->stripes[i].lock, NULL);
+    vs->stripes[i].mask = 1023;
+    vs->stripes[i].slots = (Validator *)calloc(1024, sizeof(Validator));
+    if (vs->stripes[i].slots == NULL) {
+      fprintf(MSG_OUT, "calloc failed!\n");
+      exit (1);
+    }
+  }
+  vs->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (vs->fd == -1) {
+    perror("open(validators)");
+    return vs;
+  }
+  in = fdopen(dup(vs->fd), "r");
+  while (in && fread(&rec, sizeof(rec), 1, in) == 1 &&
+         rec.etag_len < sizeof(etag) &&
+         fread(etag, 1, rec.etag_len, in) == rec.etag_len) {
+    ValidatorStripe *st = &vs->stripes[rec.key & (VALIDATOR_STRIPES - 1)];
+    etag[rec.etag_len] = '\0';
+    validator_set(validator_slot(st, rec.key, 1), etag,
+                  rec.last_modified, rec.size);
+    records++;
+  }
+  if (in)
+    fclose(in);
+  for (i = 0; i < VALIDATOR_STRIPES; i++)
+    vs->loaded += vs->stripes[i].count;
+  if (records > 2 * vs->loaded + 1024)
+    validators_compact(vs, path);
+  return vs;
+}
+
+/* Copy out what we know about url; returns 0 if nothing to send */
+static int validators_get(ValidatorStore *vs, const char *url, char *etag,
+                          long long *lm, unsigned long *size)
+{
+  uint64_t key = validator_key(url);
+  ValidatorStripe *st = &vs->stripes[key & (VALIDATOR_STRIPES - 1)];
+  Validator *v;
+  int found = 0;
+
+  pthread_mutex_lock(&st->lock);
+  v = validator_slot(st, key, 0);
+  if (v && (v->etag || v->last_modified)) {
+    if (v->etag)
+      strcpy(etag, v->etag);  /* shorter than VALIDATOR_ETAG_MAX */
+    else
+      etag[0] = '\0';
+    *lm = v->last_modified;
+    *size = v->size;
+    found = 1;
+  }
+  pthread_mutex_unlock(&st->lock);
+  return found;
+}
+
+/* Record the validators of a full response; none clears what we had */
+static void validators_put(ValidatorStore *vs, const char *url,
+                           const char *etag, long long lm, unsigned long size)
+{
+  uint64_t key = validator_key(url);
+  ValidatorStripe *st = &vs->stripes[key & (VALIDATOR_STRIPES - 1)];
+  Validator *v;
+
+  pthread_mutex_lock(&st->lock);
+  v = validator_slot(st, key, *etag || lm);
+  if (v && validator_set(v, etag, lm, size) && vs->fd != -1 &&
+      !validator_write(vs->fd, v))
+    perror("write(validators)");
+  pthread_mutex_unlock(&st->lock);
+}
+
+static size_t validators_count(ValidatorStore *vs)
+{
+  size_t n = 0;
+  int i;
+
+  for (i = 0; i < VALIDATOR_STRIPES; i++)
+    n += COUNT_GET(vs->stripes[i].count);
+  return n;
+}
+
+static void validators_close(ValidatorStore *vs)
+{
+  size_t j;
+  int i;
+
+  for (i = 0; i < VALIDATOR_STRIPES; i++) {
+    for (j = 0; j <= vs->stripes[i].mask; j++)
+      free(vs->stripes[i].slots[j].etag);
+    free(vs->stripes[i].slots);
+    pthread_mutex_destroy(&vs->stripes[i].lock);
+  }
+  if (vs->fd != -1)
+    close(vs->fd);
+  free(vs);
+}
+
+/* One link of a page body */
+typedef struct _PageChunk
+{
+  struct _PageChunk *next;
+  size_t len;
+  char data[PAGE_CHUNK_SIZE];
+} PageChunk;
+
+/* A page body, as a chain of chunks */
+typedef struct _PageBuf
+{
+  PageChunk *head;
+  PageChunk *tail;
+  size_t len;
+  int nchunks;
+} PageBuf;
+
+/* A URL read from the fifo, waiting for a free transfer slot */
+typedef struct _PendingUrl
+{
+  struct _PendingUrl *next;
+  size_t len;
+  long long queued_us;   /* when it was read from the fifo, kept on retry */
+  long long due_us;      /* when it joined its host's queue; in the retry
+                            heap, when it is due */
+  int lane;              /* 0 is the most urgent */
+  int attempt;           /* 0 for the first try */
+  char url[1];
+} PendingUrl;
+
+/* Latency histogram: 8 linear steps per power of two, so a percentile is
+   off by 12.5% at most. Buckets below 8 are exact. */
+#define HIST_BUCKETS 496
+
+typedef struct _Histogram
+{
+  long count[HIST_BUCKETS];
+} Histogram;
+
+static inline void hist_add(Histogram *h, long long us)
+{
+  int e, i;
+
+  if (us < 8)
+    i = us < 0 ? 0 : (int)us;
+  else {
+    e = 63 - __builtin_clzll((unsigned long long)us);
+    i = (e - 2) * 8 + (int)((us >> (e - 3)) & 7);
+  }
+  COUNT_ADD(h->count[i], 1);
+}
+
+/* Add what h counted since last to d, and catch last up; returns how many */
+static long hist_take(Histogram *d, const Histogram *h, Histogram *last)
+{
+  long n = 0, c;
+  int i;
+
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    c = COUNT_GET(h->count[i]);
+    d->count[i] += c - last->count[i];
+    n += c - last->count[i];
+    last->count[i] = c;
+  }
+  return n;
+}
+
+/* Upper bound of the bucket holding the p-th fraction of n values */
+static long long hist_pct(const Histogram *h, long n, double p)
+{
+  long rank = (long)(n * p), seen = 0;
+  int i;
+
+  if (rank >= n)
+    rank = n - 1;
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    seen += h->count[i];
+    if (seen > rank)
+      break;
+  }
+  if (i < 8)
+    return i;
+  if (i >= HIST_BUCKETS)
+    return 0;
+  return ((long long)(9 + i % 8) << (i / 8 - 1)) - 1;
+}
+
+/* A host's queue in the scheduler, see sched_place() */
+typedef struct _HostQueue
+{
+  struct _HostQueue *chain;       /* hq_table bucket */
+  struct _HostQueue *ready_next;  /* on ready_head[lane] */
+  struct _HostQueue *ready_prev;
+  unsigned int hash;              /* host_hash() */
+  int state;                      /* HQ_* */
+  int lane;                       /* HQ_READY: the list it is on */
+  PendingUrl *head[LANES];        /* URLs not started, FIFO order per lane */
+  PendingUrl *tail[LANES];
+  long queued;
+  long long ready_us;             /* HQ_READY: since when */
+  int in_flight;
+  double tokens;                  /* starts allowed now, up to HOST_BURST */
+  long long refill_us;            /* tokens are counted up to here */
+  long long next_us;              /* HQ_WAIT: when the next token is due */
+  size_t hlen;
+  char host[1];
+} HostQueue;
+
+/* Body bytes fetched from one host */
+typedef struct _HostBytes
+{
+  unsigned int hash;     /* host_hash() | 1, 0 is empty; set last */
+  char host[60];         /* truncated */
+  long pages;
+  long long wire;        /* as received, still Content-Encoded */
+  long long decoded;     /* as handed to write_cb */
+} HostBytes;
+
+typedef struct _DigestIndex DigestIndex;
+typedef struct _StoredPage StoredPage;
+
+/* Writes pages to the database, batching rows where it can */
+typedef struct _PageSink
+{
+#ifdef MYSQL_DB
+  MYSQL *conn;
+  char *query;        /* open multi-row INSERT */
+  size_t query_len;
+  size_t query_size;
+  MYSQL_STMT *stmt;   /* INSERT ... VALUES (?,?,?,?) for big pages */
+  MYSQL_BIND bind[4];
+  uint32_t size_param; /* MYSQL_TYPE_LONG reads 4 bytes */
+  unsigned long long digest_param;
+  my_bool name_null;
+  my_bool url_null;
+  int stmt_broken;    /* prepare failed, big pages are batched too */
+#else
+  PGconn *conn;
+  size_t bytes;       /* body bytes in the open batch */
+  int broken;         /* a COPY write failed, abort the batch */
+  time_t reset_at;    /* last reconnect attempt */
+#ifdef PG_UPSERT
+  int prepared;
+  char *scratch;      /* one parameter value */
+  size_t scratch_size;
+#endif
+#endif
+  int rows;           /* rows in the open batch */
+  DigestIndex *digests;
+  ValidatorStore *validators;
+  StoredPage *pending[BATCH_ROWS]; /* the open batch's rows, settled with it */
+  int npending;
+  long stored;        /* rows written */
+  long failed;        /* rows lost to errors */
+  long batches;       /* statements sent */
+  long full_batches;  /* batches flushed because they were full */
+  long streamed;      /* rows sent one by one as binary parameters */
+  long long put_us;   /* time spent handing rows to the database */
+} PageSink;
+
+/* A finished page on its way to the database */
+struct _StoredPage
+{
+  PageBuf page;
+  unsigned long size;
+  long long queued_ms;  /* when it was handed to the persistence stage */
+  char charset[32];     /* from Content-Type, empty if none */
+  char *url;            /* NULL for a row without url and digest */
+  uint64_t digest;      /* XXH64 of the body as received */
+  int encoded;          /* still Content-Encoded, see STORE_ENCODED */
+  int tries;            /* transfers it took, for a dead letter */
+  int claimed;          /* the digest is new to the index, see digest_claim() */
+  char *etag;           /* validators to record once the row is stored, */
+  long long last_modified; /* NULL etag if there are none to record */
+};
+
+/* Bounded lock-free queue of StoredPage (Vyukov's MPMC ring).  Each cell's
+   seq says whose turn it is: pos for the producer, pos+1 for the consumer. */
+typedef struct _PageQueueCell
+{
+  volatile size_t seq;
+  StoredPage *page;
+} PageQueueCell;
+
+typedef struct _PersistStage PersistStage;
+
+typedef struct _IconvSlot
+{
+  char name[32];
+  iconv_t cd;                 /* (iconv_t)-1 if the charset is unknown */
+} IconvSlot;
+
+/* One writer thread and its database connection */
+typedef struct _PageWriter
+{
+  pthread_t tid;
+  PersistStage *stage;
+  PageSink sink;
+  long lag_ms;                /* queue wait of the last page taken */
+  long lag_max_ms;            /* since the last stats tick, COUNT_MAX */
+  IconvSlot iconv[ICONV_CACHE];
+  int niconv;
+  int iconv_next;             /* slot to reuse once all are taken */
+  long tc_converted;          /* pages transcoded */
+  long tc_skipped;            /* ASCII or UTF-8 already */
+  long tc_failed;             /* no converter, stored as they came */
+  long tc_too_large;          /* over MAX_WEBPAGE_SIZE once converted */
+  long tc_dropped;            /* invalid bytes left out */
+  long long tc_us;            /* time spent deciding and converting */
+  long dedup_checked;         /* bodies looked up in the digest index */
+  long dedup_hits;            /* ... and found, stored without the body */
+  long long dedup_saved;      /* body bytes not written */
+} PageWriter;
+
+/* Finished pages go from the loop thread to the writers through queue */
+struct _PersistStage
+{
+  PageQueueCell *cells;
+  size_t mask;
+  volatile size_t enqueue_pos;
+  char pad[64];               /* keep producer and consumers apart */
+  volatile size_t dequeue_pos;
+  sem_t items;                /* pages in the queue, writers sleep on it */
+  const char *conninfo;
+  DigestIndex *digests;
+  ValidatorStore *validators; /* recorded as rows are stored */
+  struct _SeenFilter *seen;   /* NULL if disabled */
+  PageWriter *writers;
+  int nwriters;
+  volatile int stop;
+  long stalls;                /* pushes that found the queue full */
+  long last_stored;           /* rows stored at the previous stats tick */
+  long last_transcoded;
+  long long last_tc_us;
+};
+
+/* Buffered reader for the fifo. Bytes in [start, end) are unparsed; a
+   partial URL at the end is moved to the front before the next read(). */
+typedef struct _LineReader
+{
+  int fd;
+  char *buf;
+  size_t size;
+  size_t start;
+  size_t end;
+  long urls;           /* URLs handed to the dispatcher */
+  long busy_ns;        /* time spent reading and splitting */
+  long last_urls;
+  long last_busy_ns;
+  int lane;            /* set by a priority field for the next URL, or -1 */
+} LineReader;
+
+struct _ConnInfo;
+struct _SeenFilter;
+
+/* Ways a transfer can fail that are worth another try */
+enum { RETRY_DNS, RETRY_CONNECT, RETRY_TIMEOUT, RETRY_RESET, RETRY_5XX,
+       RETRY_429, RETRY_CLASSES };
+
+/* Deadlines a transfer can be reaped for */
+enum { REAP_CONNECT, REAP_FIRST_BYTE, REAP_LOW_SPEED, REAP_TOTAL,
+       REAP_REASONS };
+
+/* Global information, common to all connections.
+   With FETCH_THREADS > 1 there is one per loop thread (a shard); the fifo
+   and the stats timer live on shard 0, which runs on the main thread. */
+typedef struct _GlobalInfo
+{
+  int id;
+  pthread_t tid;
+  struct _GlobalInfo *shards;  /* all shards, shards[0] reads the fifo */
+  int nshards;
+  Loop *loop;
+  Watch *fifo_event;
+  Watch *timer_event;
+  Watch *stats_event;
+  CURLM *multi;
+  int still_running;
+  LineReader input;
+  struct _ConnInfo *conn_pool; /* idle ConnInfo, easy handle kept alive */
+  int conn_pool_len;
+  struct _SockInfo *sock_pool; /* idle SockInfo, watcher kept */
+  int sock_pool_len;
+  long sock_new;               /* SockInfo taken from the pool or allocated */
+  long sock_allocs;
+  long sock_changes;           /* interest changes re-armed in place */
+  long sock_same;              /* calls that didn't change the interest */
+  int in_flight;               /* easy handles added to multi */
+  HostQueue **hq_table;        /* hosts known to the scheduler, chained */
+  size_t hq_mask;
+  int hq_count;
+  HostQueue *ready_head[LANES]; /* hosts that may start a transfer now, */
+  HostQueue *ready_tail[LANES]; /* by their most urgent URL */
+  int hosts_ready;
+  int lane_cur;                /* weighted draining: lane being served */
+  int lane_credit[LANES];      /* ... and the starts left this round */
+  HostQueue **wait_heap;       /* hosts out of tokens, by next_us */
+  int wait_len;
+  int wait_size;
+  int hosts_capped;            /* at HOST_MAX_IN_FLIGHT with URLs queued */
+  long sched_delayed;          /* times a host had to wait for a token */
+  long last_sched_delayed;
+  Watch *sched_event;          /* due at wait_heap[0]->next_us */
+  PendingUrl **retry_heap;     /* failed URLs waiting out a backoff, by due */
+  int retry_len;
+  int retry_size;
+  size_t retry_bytes;
+  Watch *retry_event;          /* due at retry_heap[0]->due_us */
+  uint64_t rng;                /* backoff jitter */
+  long failed[RETRY_CLASSES];  /* transfers failed, retried or not */
+  long retries[RETRY_CLASSES]; /* retries scheduled */
+  long retry_ok;               /* URLs that succeeded on a retry */
+  long dead;                   /* ... and that ran out of them */
+  struct _ConnInfo **deadline_heap; /* transfers in flight, by deadline_us */
+  int deadline_len;
+  int deadline_size;
+  Watch *deadline_event;       /* due at deadline_heap[0]->deadline_us */
+  long reaped[REAP_REASONS];
+  Histogram reap_stall;        /* silence before a transfer was reaped, us */
+  Histogram last_reap_stall;
+  long pending;
+  size_t pending_bytes;
+  int max_in_flight;           /* this shard's part of MAX_PARALLEL_WORKER */
+  long started;
+  long completed;
+  long last_completed;         /* at the previous stats tick */
+  Histogram lane_wait[LANES];  /* host queue to transfer start, us */
+  Histogram lane_done[LANES];  /* fifo to last try done, us */
+  Histogram last_lane_wait[LANES]; /* at the previous stats tick */
+  Histogram last_lane_done[LANES];
+  long long wait_us;           /* host queue to transfer start, summed */
+  long long wait_max_us;       /* since the previous stats tick, COUNT_MAX */
+  long long last_wait_us;
+  long last_started;
+  long last_dispatched;
+  long last_sock_changes;
+  long last_sock_same;
+  PersistStage *persist;
+  /* URLs handed over by the dispatcher on shard 0 */
+  pthread_mutex_t inbox_lock;
+  PendingUrl *inbox_head;
+  PendingUrl *inbox_tail;
+  long inbox;
+  size_t inbox_bytes;
+  int inbox_fd;                /* eventfd, written when the inbox becomes non-empty */
+  Watch *inbox_event;
+  int stopping;                /* set by main, acted on by inbox_cb */
+  /* dispatcher side, only touched by shard 0 */
+  PendingUrl *outbox_head;
+  PendingUrl *outbox_tail;
+  long outbox;
+  size_t outbox_bytes;
+  struct _SeenFilter *seen;    /* shared by all shards, NULL if disabled */
+  ValidatorStore *validators;  /* shared by all shards */
+  long cond_sent;              /* requests carrying validators */
+  long not_modified;           /* ... answered 304 */
+  long long nm_bytes;          /* body bytes those would have cost */
+  HostBytes *hosts;            /* HOST_STATS_SLOTS, open addressing */
+  long *host_last_pages;       /* stats_cb's: hosts[].pages at its last tick */
+  int nhosts;
+  long hosts_untracked;        /* transfers from hosts the table had no room for */
+  long long wire_bytes;        /* all transfers, tracked or not */
+  long long decoded_bytes;
+  CURLSH *share;               /* the same for all shards */
+  long connects;               /* connections opened by finished transfers */
+  long tls_full;               /* TLS handshakes, without and */
+  long tls_resumed;            /* ... with a cached session */
+  long h2_pages;               /* transfers done over HTTP/2 */
+  long last_connects;
+  /* fifo flow control, shard 0 only: 0 reading, 1 paused, 2 woken */
+  int fifo_paused;
+  long fifo_pauses;
+  int resume_fd;
+  Watch *resume_event;
+  int metrics_fd;              /* shard 0: METRICS_LISTEN, -1 if off */
+  Watch *metrics_event;
+  double pages_per_sec;        /* over the last stats tick */
+} GlobalInfo;
+
+
+/* Information associated with a specific easy handle.
+   ConnInfo objects are recycled through GlobalInfo.conn_pool together with
+   their easy handle, so only the per-transfer fields are reset between URLs.
+   The body lives in chunks outside the struct, keeping the hot fields
+   together at the front. */
+typedef struct _ConnInfo
+{
+  CURL *easy;
+  char *url;
+  size_t url_size;   /* capacity of url, grown as needed */
+  GlobalInfo *global;
+  PageBuf page;
+  HostQueue *hq;     /* the scheduler's host, told when we're done */
+  int lane;
+  int attempt;
+  long long queued_us; /* when the URL was read from the fifo */
+  long retry_after_ms; /* the Retry-After of the last response, 0 if none */
+  long long start_us;  /* handed to curl */
+  long long connected_us; /* curl gave it a connection, 0 before */
+  long long first_rx_us; /* first header byte, 0 before */
+  long long last_rx_us;
+  long long rx_bytes;  /* headers and body */
+  long long window_us; /* low-speed window, 0 until the first check */
+  long long window_rx; /* rx_bytes when it started */
+  long long deadline_us; /* next check, 0 for none */
+  int deadline_idx;    /* in GlobalInfo.deadline_heap, -1 if not there */
+  int reaped;          /* REAP_* that ended it, -1 */
+  int truncated;       /* aborted at MAX_WEBPAGE_SIZE */
+  Xxh64 hash;        /* of the body received so far */
+  char etag[VALIDATOR_ETAG_MAX];  /* validators of the last response */
+  long long last_modified;
+  struct curl_slist *cond_headers; /* If-None-Match, NULL if none */
+  int conditional;   /* validators were sent */
+  unsigned long cond_size; /* size of the copy they stand for */
+  int encoded;       /* the last response had a Content-Encoding */
+  int tls_reused;    /* 0 not looked at, 1 unknown, 2 full, 3 resumed */
+  struct _ConnInfo *next; /* conn_pool link */
+  char error[CURL_ERROR_SIZE];
+} ConnInfo;
+
+
+/* Information associated with a specific socket */
+typedef struct _SockInfo
+{
+  curl_socket_t sockfd;
+  CURL *easy;
+  int action;
+  long timeout;
+  Watch *ev;
+  GlobalInfo *global;
+  struct _SockInfo *next;  /* in the idle pool */
+} SockInfo;
+
+
+
+/* Update the event timer after curl_multi library calls */
+static int multi_timer_cb(CURLM *multi, long timeout_ms, GlobalInfo *g)
+{
+  (void)multi; /* unused */
+
+  watch_timer(g->timer_event, timeout_ms);  /* -1 deletes it */
+#ifdef DEBUG
+  fprintf(MSG_OUT, "multi_timer_cb: Setting timeout to %ld ms\n", timeout_ms);
+#endif
+  return 0;
+}
+
+/* Die if we get a bad CURLMcode somewhere */
+static void mcode_or_die(const char *where, CURLMcode code)
+{
+  if ( CURLM_OK != code ) {
+    const char *s;
+    switch (code) {
+      case     CURLM_CALL_MULTI_PERFORM: s="CURLM_CALL_MULTI_PERFORM"; break;
+      case     CURLM_BAD_HANDLE:         s="CURLM_BAD_HANDLE";         break;
+      case     CURLM_BAD_EASY_HANDLE:    s="CURLM_BAD_EASY_HANDLE";    break;
+      case     CURLM_OUT_OF_MEMORY:      s="CURLM_OUT_OF_MEMORY";      break;
+      case     CURLM_INTERNAL_ERROR:     s="CURLM_INTERNAL_ERROR";     break;
+      case     CURLM_UNKNOWN_OPTION:     s="CURLM_UNKNOWN_OPTION";     break;
+      case     CURLM_LAST:               s="CURLM_LAST";               break;
+      default: s="CURLM_unknown";
+        break;
+    case     CURLM_BAD_SOCKET:         s="CURLM_BAD_SOCKET";
+
+      fprintf(MSG_OUT, "ERROR: %s returns %s\n", where, s);
+      /* ignore this error */
+      return;
+    }
+    fprintf(MSG_OUT, "ERROR: %s returns %s\n", where, s);
+    exit(code);
+  }
+}
+
+
+
+/* --------------------------------
+   Page buffers
+
+   A page body is kept as a chain of fixed size chunks, so an in-flight
+   transfer only holds what it has actually received.  Chunks come from
+   slabs of PAGE_SLAB_CHUNKS and go back to a free list when the page is
+   stored; the chain is handed to the sink as an iovec, never flattened. */
+static PageChunk *g_chunk_free = NULL;
+static long g_chunk_total = 0;  // chunks carved from slabs
+static long g_chunk_used = 0;   // chunks held by pages
+/* pages are filled on the loop thread and released by the writers */
+static pthread_mutex_t g_chunk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static PageChunk *chunk_alloc(void)
+{
+  PageChunk *c;
+
+  pthread_mutex_lock(&g_chunk_lock);
+  c = g_chunk_free;
+  if (!c) {
+    PageChunk *slab = (PageChunk *)malloc(sizeof(PageChunk) * PAGE_SLAB_CHUNKS);
+    int i;
+
+    if (slab == NULL) {
+      fprintf(MSG_OUT, "malloc failed!\n");
+      exit (1);
+    }
+    for (i = 0; i < PAGE_SLAB_CHUNKS - 1; i++)
+      slab[i].next = &slab[i+1];
+    slab[PAGE_SLAB_CHUNKS-1].next = NULL;
+    g_chunk_total += PAGE_SLAB_CHUNKS;
+    c = slab;
+  }
+  g_chunk_free = c->next;
+  g_chunk_used++;
+  pthread_mutex_unlock(&g_chunk_lock);
+  c->next = NULL;
+  c->len = 0;
+  return c;
+}
+
+/* Append len bytes to the page, growing the chain as needed */
+static void page_append(PageBuf *page, const char *ptr, size_t len)
+{
+  while (len > 0) {
+    PageChunk *c = page->tail;
+    size_t n;
+
+    if (!c || c->len == PAGE_CHUNK_SIZE) {
+      c = chunk_alloc();
+      if (page->tail)
+        page->tail->next = c;
+      else
+        page->head = c;
+      page->tail = c;
+      page->nchunks++;
+    }
+    n = PAGE_CHUNK_SIZE - c->len;
+    if (n > len)
+      n = len;
+    memcpy(c->data + c->len, ptr, n);
+    c->len += n;
+    page->len += n;
+    ptr += n;
+    len -= n;
+  }
+}
+
+/* Fill iov with the page's chunks, returns the number of entries used */
+static int page_iov(const PageBuf *page, struct iovec *iov, int max)
+{
+  const PageChunk *c;
+  int n = 0;
+
+  for (c = page->head; c && n < max; c = c->next, n++) {
+    iov[n].iov_base = (void *)c->data;
+    iov[n].iov_len = c->len;
+  }
+  return n;
+}
+
+/* Give all chunks of the page back to the free list */
+static void page_release(PageBuf *page)
+{
+  if (page->head) {
+    pthread_mutex_lock(&g_chunk_lock);
+    page->tail->next = g_chunk_free;
+    g_chunk_free = page->head;
+    g_chunk_used -= page->nchunks;
+    pthread_mutex_unlock(&g_chunk_lock);
+  }
+  memset(page, 0, sizeof(PageBuf));
+}
+
+
+/* --------------------------------
+   Database sink */
+
+static void digest_commit(DigestIndex *di, uint64_t d);
+static void digest_drop(DigestIndex *di, uint64_t d);
+
+/* A row is in the database, or lost.  Keep the digest of a body that was
+   stored, forget one that was not, so a later fetch stores the body
+   instead of pointing at nothing.  The validators are recorded only for a
+   stored row too: a 304 for a page we never stored would leave it
+   missing for good.  Frees sp. */
+static void sink_done(PageSink *sink, StoredPage *sp, int ok)
+{
+  if (sp->claimed) {
+    if (ok)
+      digest_commit(sink->digests, sp->digest);
+    else
+      digest_drop(sink->digests, sp->digest);
+  }
+  if (ok && sp->etag)
+    validators_put(sink->validators, sp->url, sp->etag, sp->last_modified,
+                   sp->size);
+  page_release(&sp->page);
+  free(sp->etag);
+  free(sp->url);
+  free(sp);
+}
+
+/* Settle the rows of the open batch */
+static void sink_settle(PageSink *sink, int ok)
+{
+  int i;
+
+  for (i = 0; i < sink->npending; i++)
+    sink_done(sink, sink->pending[i], ok);
+  sink->npending = 0;
+}
+
+/* A row joins the open batch: its body has been copied out, the rest is
+   settled with the batch */
+static void sink_hold(PageSink *sink, StoredPage *sp)
+{
+  page_release(&sp->page);
+  sink->pending[sink->npending++] = sp;
+}
+
+static void sink_open(PageSink *sink, const char *conninfo)
+{
+  memset(sink, 0, sizeof(PageSink));
+#ifdef MYSQL_DB
+	(void)conninfo;
+	//printf("MySQL client version: %s\n", mysql_get_client_info());return 0;		
+	sink->conn = mysql_init(NULL);
+	//mysql_real_connect(sink->conn, "192.168.4.192", "root", "123456", "mydomain", 0, NULL, 0);	
+	mysql_real_connect(sink->conn, "localhost", "root", "30083012", "mydomain", 0, NULL, 0);	
+	//mysql_real_connect(sink->conn, "192.168.1.102", "root", "123456", "test", 0, NULL, 0);	
+	mysql_set_character_set(sink->conn, "utf8");  /* pages are transcoded to TRANSCODE_TO */
+#else
+	if (conninfo == NULL)
+		conninfo = "host='192.168.21.90' port='5432' dbname='test' user='pguser' password='123456' connect_timeout='1000'";
+	sink->conn = PQconnectdb(conninfo);
+	if (PQstatus(sink->conn) != CONNECTION_OK)
+		fprintf(stderr, "Connection to database failed: %s", PQerrorMessage(sink->conn));
+	if(0 != PQsetClientEncoding(sink->conn, "UTF8"))		fprintf(MSG_OUT, "PQsetClientEncoding() failed");
+#endif	
+}
+
+#ifdef MYSQL_DB
+static const char batch_head[] =
+  "INSERT IGNORE INTO writers (name,size,url,digest) VALUES";
+
+/* Make room for need bytes in the open statement */
+static void sink_reserve(PageSink *sink, size_t need)
+{
+  if (need <= sink->query_size)
+    return;
+  sink->query = (char *)realloc(sink->query, need);
+  if (sink->query == NULL) {
+    fprintf(MSG_OUT, "realloc failed!\n");
+    exit (1);
+  }
+  sink->query_size = need;
+}
+
+/* Send the open batch as one multi-row INSERT */
+static void sink_flush(PageSink *sink)
+{
+  if (!sink->rows)
+    return;
+
+	  if (mysql_real_query(sink->conn, sink->query, (unsigned long)sink->query_len)) {
+		  fprintf(stderr, "Failed to insert %d rows, Error: %s\n",
+			  sink->rows, mysql_error(sink->conn));
+		  COUNT_ADD(sink->failed, sink->rows);
+		  sink_settle(sink, 0);
+	  } else {
+		COUNT_ADD(sink->stored, sink->rows);
+		sink_settle(sink, 1);
+	  }
+  COUNT_ADD(sink->batches, 1);
+  sink->rows = 0;
+  sink->query_len = 0;
+}
+
+/* Prepare the statement for big pages, once per connection */
+static int sink_prepare(PageSink *sink)
+{
+  static const char put_page[] =
+    "INSERT IGNORE INTO writers (name,size,url,digest) VALUES (?,?,?,?)";
+
+  if (sink->stmt)
+    return 1;
+  if (sink->stmt_broken)
+    return 0;
+  sink->stmt = mysql_stmt_init(sink->conn);
+  if (sink->stmt &&
+      !mysql_stmt_prepare(sink->stmt, put_page, sizeof(put_page) - 1)) {
+    memset(sink->bind, 0, sizeof(sink->bind));
+    sink->bind[0].buffer_type = MYSQL_TYPE_BLOB;  /* sent as long data */
+    sink->bind[0].is_null = &sink->name_null;
+    sink->bind[1].buffer_type = MYSQL_TYPE_LONG;
+    sink->bind[1].buffer = &sink->size_param;
+    sink->bind[1].is_unsigned = 1;
+    sink->bind[2].buffer_type = MYSQL_TYPE_BLOB;  /* long data too */
+    sink->bind[2].is_null = &sink->url_null;
+    sink->bind[3].buffer_type = MYSQL_TYPE_LONGLONG;
+    sink->bind[3].buffer = &sink->digest_param;
+    sink->bind[3].is_unsigned = 1;
+    sink->bind[3].is_null = &sink->url_null;
+    if (!mysql_stmt_bind_param(sink->stmt, sink->bind))
+      return 1;
+  }
+  fprintf(stderr, "Failed to prepare INSERT, Error: %s\n",
+          sink->stmt ? mysql_stmt_error(sink->stmt) : mysql_error(sink->conn));
+  if (sink->stmt)
+    mysql_stmt_close(sink->stmt);
+  sink->stmt = NULL;
+  sink->stmt_broken = 1;
+  return 0;
+}
+
+/* Send one page as a binary parameter, chunk by chunk from the page
+   buffer: nothing is escaped, copied or parsed as SQL */
+static void sink_put_stmt(PageSink *sink, StoredPage *sp,
+                          const struct iovec *iov, int iovcnt)
+{
+  const char *url = sp->url;
+  int i, err = 0;
+
+  for (i = 0; iov && i < iovcnt && !err; i++)
+    err = mysql_stmt_send_long_data(sink->stmt, 0,
+                                    (const char *)iov[i].iov_base,
+                                    (unsigned long)iov[i].iov_len);
+  if (url && !err)
+    err = mysql_stmt_send_long_data(sink->stmt, 2, url, strlen(url));
+  sink->name_null = iov == NULL;
+  sink->url_null = url == NULL;
+  sink->size_param = (uint32_t)sp->size;
+  sink->digest_param = sp->digest;
+  if (err || mysql_stmt_execute(sink->stmt)) {
+    fprintf(stderr, "Failed to insert page, Error: %s\n",
+            mysql_stmt_error(sink->stmt));
+    mysql_stmt_reset(sink->stmt);  /* drop long data already sent */
+    COUNT_ADD(sink->failed, 1);
+    sink_done(sink, sp, 0);
+  } else {
+    COUNT_ADD(sink->stored, 1);
+    sink_done(sink, sp, 1);
+  }
+  COUNT_ADD(sink->streamed, 1);
+}
+
+/* Add one row to the open batch.  The chunks are escaped straight into the
+   statement, so the page buffer can be released as soon as this returns.
+   Pages of STMT_MIN_BYTES and more skip the batch and are streamed; when
+   the statement can't be prepared they are batched, and the batch is sent
+   before it would pass BATCH_MAX_BYTES.  A
+   NULL iov stores the row without a body, a NULL url without url and
+   digest.  The sink owns sp from here on. */
+static void sink_put(PageSink *sink, StoredPage *sp, const struct iovec *iov,
+                     int iovcnt, size_t len)
+{
+  const char *url = sp->url;
+  unsigned long size = sp->size;
+  uint64_t digest = sp->digest;
+  size_t url_len = url ? strlen(url) : 0;
+  /* worst case every byte is escaped */
+  size_t need = 2 * len + 2 * url_len + 64;
+  char *end;
+  int i;
+
+  if (iov && len >= STMT_MIN_BYTES && sink_prepare(sink)) {
+    sink_put_stmt(sink, sp, iov, iovcnt);
+    return;
+  }
+
+  if (sink->rows && sink->query_len + need > BATCH_MAX_BYTES) {
+    COUNT_ADD(sink->full_batches, 1);
+    sink_flush(sink);
+  }
+  if (!sink->rows) {
+    sink_reserve(sink, sizeof(batch_head) + need);
+    memcpy(sink->query, batch_head, sizeof(batch_head) - 1);
+    sink->query_len = sizeof(batch_head) - 1;
+  } else {
+    sink_reserve(sink, sink->query_len + need);
+    sink->query[sink->query_len++] = ',';
+  }
+
+  end = sink->query + sink->query_len;
+	  *end++ = '(';
+	  if (iov) {
+		  *end++ = '\'';
+		  for (i = 0; i < iovcnt; i++)
+			  end += mysql_real_escape_string(sink->conn, end,
+				  (const char*)iov[i].iov_base, iov[i].iov_len);
+		  *end++ = '\'';
+	  } else {
+		  end += sprintf(end, "NULL");
+	  }
+	  end += sprintf(end, ",%lu,", size);
+	  if (url) {
+		  *end++ = '\'';
+		  end += mysql_real_escape_string(sink->conn, end, url, url_len);
+		  end += sprintf(end, "',%llu)", (unsigned long long)digest);
+	  } else {
+		  end += sprintf(end, "NULL,NULL)");
+	  }
+  sink->query_len = end - sink->query;
+  sink_hold(sink, sp);
+
+  /* a row over the limit on its own goes out alone, never as the head of
+     a batch that keeps growing */
+  if (++sink->rows >= BATCH_ROWS || sink->query_len >= BATCH_MAX_BYTES) {
+    COUNT_ADD(sink->full_batches, 1);
+    sink_flush(sink);
+  }
+}
+
+static void sink_close(PageSink *sink)
+{
+  sink_flush(sink);
+  //mysql_query(sink->conn, "INSERT INTO writers (name,size) VALUES('done!', 9)");
+  if (sink->stmt)
+    mysql_stmt_close(sink->stmt);
+  mysql_close(sink->conn);
+  free(sink->query);
+}
+#else
+/* Binary COPY framing, see "COPY ... (FORMAT binary)" in the PostgreSQL docs */
+static void put_int32(char *p, long v)
+{
+  unsigned int n = htonl((unsigned int)v);
+  memcpy(p, &n, 4);
+}
+
+static void put_int64(char *p, uint64_t v)
+{
+  put_int32(p, (long)(v >> 32));
+  put_int32(p + 4, (long)(v & 0xffffffffu));
+}
+
+#ifndef PG_UPSERT
+/* Binary COPY framing, see "COPY ... (FORMAT binary)" in the PostgreSQL docs */
+static const char copy_head[] = "PGCOPY\n\377\r\n\0" "\0\0\0\0" "\0\0\0\0";
+static const char copy_tail[2] = {'\377', '\377'};
+
+static void put_int16(char *p, int v)
+{
+  unsigned short n = htons((unsigned short)v);
+  memcpy(p, &n, 2);
+}
+#endif
+
+/* Start a COPY, or with PG_UPSERT enter pipeline mode */
+static int sink_begin(PageSink *sink)
+{
+  if (PQstatus(sink->conn) != CONNECTION_OK) {
+    /* the server went away: connect again, at most once a second so a
+       database that is down doesn't stall the writer on every row */
+    time_t now = time(NULL);
+
+    if (now == sink->reset_at)
+      return 0;
+    sink->reset_at = now;
+    PQreset(sink->conn);
+    if (PQstatus(sink->conn) != CONNECTION_OK) {
+      fprintf(stderr, "Reconnect to database failed: %s", PQerrorMessage(sink->conn));
+      return 0;
+    }
+    if (0 != PQsetClientEncoding(sink->conn, "UTF8"))
+      fprintf(MSG_OUT, "PQsetClientEncoding() failed");
+#ifdef PG_UPSERT
+    sink->prepared = 0;  /* statements die with the session */
+#endif
+  }
+#ifdef PG_UPSERT
+  if (!sink->prepared) {
+    /* prepare once, outside the pipeline */
+    PGresult *res = PQprepare(sink->conn, "put_page",
+      "INSERT INTO writers (name,size,url,digest) "
+      "VALUES($1::text, $2::int, $3::text, $4::bigint) "
+      "ON CONFLICT DO NOTHING", 4, NULL);
+    sink->prepared = PQresultStatus(res) == PGRES_COMMAND_OK;
+    PQclear(res);
+    if (!sink->prepared) {
+      fprintf(stderr, "PQprepare failed: %s", PQerrorMessage(sink->conn));
+      return 0;
+    }
+  }
+  if (PQpipelineStatus(sink->conn) == PQ_PIPELINE_OFF &&
+      PQenterPipelineMode(sink->conn) != 1) {
+    fprintf(stderr, "PQenterPipelineMode failed: %s", PQerrorMessage(sink->conn));
+    return 0;
+  }
+  return 1;
+#else
+  PGresult *res = PQexec(sink->conn,
+    "COPY writers (name,size,url,digest) FROM STDIN (FORMAT binary)");
+  ExecStatusType st = PQresultStatus(res);
+
+  PQclear(res);
+  if (st != PGRES_COPY_IN) {
+    puts( PQresStatus(st) );
+    puts( PQerrorMessage(sink->conn) );
+    puts( "command error! copy" );
+    return 0;
+  }
+  if (PQputCopyData(sink->conn, copy_head, sizeof(copy_head) - 1) != 1)
+    sink->broken = 1;
+  return 1;
+#endif
+}
+
+/* End the open batch: finish the COPY, or sync the pipeline and collect one
+   result per row */
+static void sink_flush(PageSink *sink)
+{
+  PGresult *res;
+  int ok = 0;
+
+  if (!sink->rows)
+    return;
+
+#ifdef PG_UPSERT
+  if (PQpipelineSync(sink->conn) == 1) {
+    int nulls = 0;
+
+    /* every query yields its result then a NULL, the sync its own result */
+    for (;;) {
+      res = PQgetResult(sink->conn);
+      if (res == NULL) {
+        if (++nulls > sink->rows)
+          break;  /* connection lost */
+        continue;
+      }
+      ExecStatusType st = PQresultStatus(res);
+      PQclear(res);
+      if (st == PGRES_PIPELINE_SYNC)
+        break;
+      if (st == PGRES_COMMAND_OK)
+        ok++;
+      else if (st != PGRES_PIPELINE_ABORTED)
+        fprintf(stderr, "insert failed: %s", PQerrorMessage(sink->conn));
+    }
+  } else {
+    fprintf(stderr, "PQpipelineSync failed: %s", PQerrorMessage(sink->conn));
+  }
+#else
+  if (!sink->broken &&
+      PQputCopyData(sink->conn, copy_tail, sizeof(copy_tail)) == 1 &&
+      PQputCopyEnd(sink->conn, NULL) == 1) {
+    ok = 1;
+  } else {
+    PQputCopyEnd(sink->conn, "send failed");
+  }
+  while ((res = PQgetResult(sink->conn))) {
+    ExecStatusType st = PQresultStatus(res);
+    if (st != PGRES_COMMAND_OK) {
+      puts( PQresStatus(st) );
+      puts( PQresultErrorMessage(res) );
+      puts( "command error! copy" );
+      ok = 0;
+    }
+    PQclear(res);
+  }
+  /* a COPY is all or nothing */
+  ok = ok ? sink->rows : 0;
+#endif
+
+  COUNT_ADD(sink->stored, ok);
+  COUNT_ADD(sink->failed, sink->rows - ok);
+  /* which upserts failed isn't tracked: keep the digests only if none did */
+  sink_settle(sink, ok == sink->rows);
+  COUNT_ADD(sink->batches, 1);
+  sink->rows = 0;
+  sink->bytes = 0;
+  sink->broken = 0;
+}
+
+/* Add one row to the open batch.  In COPY mode the chunks are sent as they
+   are, no escaping and no flattening.  A NULL iov stores the row without a
+   body, a NULL url without url and digest.  The sink owns sp from here
+   on. */
+static void sink_put(PageSink *sink, StoredPage *sp, const struct iovec *iov,
+                     int iovcnt, size_t len)
+{
+  const char *url = sp->url;
+  unsigned long size = sp->size;
+  uint64_t digest = sp->digest;
+  size_t url_len = url ? strlen(url) : 0;
+  int i;
+
+  if (sink->rows && sink->bytes + len > BATCH_MAX_BYTES) {
+    COUNT_ADD(sink->full_batches, 1);
+    sink_flush(sink);
+  }
+  if (!sink->rows && !sink_begin(sink)) {
+    COUNT_ADD(sink->failed, 1);
+    sink_done(sink, sp, 0);
+    return;
+  }
+
+#ifdef PG_UPSERT
+  /* a parameter has to be in one piece */
+  char *p;
+  if (len > sink->scratch_size) {
+    free(sink->scratch);
+    sink->scratch = (char *)malloc(len + 1);
+    if (sink->scratch == NULL) {
+      fprintf(MSG_OUT, "malloc failed!\n");
+      exit (1);
+    }
+    sink->scratch_size = len;
+  }
+  for (i = 0, p = sink->scratch; iov && i < iovcnt; i++) {
+    memcpy(p, iov[i].iov_base, iov[i].iov_len);
+    p += iov[i].iov_len;
+  }
+
+  char nsize[4];
+  char ndigest[8];
+  put_int32(nsize, (long)size);
+  put_int64(ndigest, digest);
+  /* an empty body is '', only a missing one is NULL */
+  const char *values[4] = {iov ? (len ? sink->scratch : "") : NULL, nsize,
+                           url, url ? ndigest : NULL};
+  int lengths[4] = {(int)len, 4, (int)url_len, 8};
+  int binary[4] = {1, 1, 1, 1};  // text in binary format is the raw bytes
+
+  if (PQsendQueryPrepared(sink->conn, "put_page", 4, values, lengths,
+                          binary, 0) != 1) {
+    fprintf(stderr, "PQsendQueryPrepared failed: %s", PQerrorMessage(sink->conn));
+    COUNT_ADD(sink->failed, 1);
+    sink_done(sink, sp, 0);
+    if (!sink->rows)
+      PQexitPipelineMode(sink->conn);
+    return;
+  }
+#else
+  char head[2 + 4];
+  char mid[4 + 4 + 4];
+  char tail[4 + 8];
+
+  put_int16(head, 4);             // field count
+  put_int32(head + 2, iov ? (long)len : -1); // name, -1 is NULL
+  put_int32(mid, 4);              // size
+  put_int32(mid + 4, (long)size);
+  put_int32(mid + 8, url ? (long)url_len : -1); // url
+  put_int32(tail, url ? 8 : -1);  // digest
+  put_int64(tail + 4, digest);
+  if (PQputCopyData(sink->conn, head, sizeof(head)) != 1)
+    sink->broken = 1;
+  for (i = 0; iov && i < iovcnt && !sink->broken; i++)
+    if (PQputCopyData(sink->conn, (const char *)iov[i].iov_base,
+                      (int)iov[i].iov_len) != 1)
+      sink->broken = 1;
+  if (!sink->broken && PQputCopyData(sink->conn, mid, sizeof(mid)) != 1)
+    sink->broken = 1;
+  if (!sink->broken && url_len &&
+      PQputCopyData(sink->conn, url, (int)url_len) != 1)
+    sink->broken = 1;
+  if (!sink->broken &&
+      PQputCopyData(sink->conn, tail, url ? sizeof(tail) : 4) != 1)
+    sink->broken = 1;
+#endif
+
+  sink_hold(sink, sp);
+  sink->bytes += len;
+  if (++sink->rows >= BATCH_ROWS) {
+    COUNT_ADD(sink->full_batches, 1);
+    sink_flush(sink);
+  }
+}
+
+static void sink_close(PageSink *sink)
+{
+  sink_flush(sink);
+#ifdef PG_UPSERT
+  PQexitPipelineMode(sink->conn);
+  free(sink->scratch);
+#endif
+  PQfinish(sink->conn);
+}
+#endif
+
+
+/* --------------------------------
+   Persistence stage
+
+   Storage runs on WRITER_THREADS threads, each with its own PageSink, so
+   a slow INSERT never holds up the event loop.  The loop pushes finished
+   pages on a lock-free ring; the writers batch them exactly as the sink
+   did inline, flushing a partial batch after BATCH_FLUSH_MS. */
+
+static int persist_push(PersistStage *ps, StoredPage *sp)
+{
+  PageQueueCell *cell;
+  size_t pos = __atomic_load_n(&ps->enqueue_pos, __ATOMIC_RELAXED);
+
+  for (;;) {
+    cell = &ps->cells[pos & ps->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    long dif = (long)seq - (long)pos;
+    if (dif == 0) {
+      if (__sync_bool_compare_and_swap(&ps->enqueue_pos, pos, pos + 1))
+        break;
+      pos = __atomic_load_n(&ps->enqueue_pos, __ATOMIC_RELAXED);
+    } else if (dif < 0) {
+      return 0;  /* full */
+    } else {
+      pos = __atomic_load_n(&ps->enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+  cell->page = sp;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+  sem_post(&ps->items);
+  return 1;
+}
+
+static StoredPage *persist_pop(PersistStage *ps)
+{
+  PageQueueCell *cell;
+  size_t pos = __atomic_load_n(&ps->dequeue_pos, __ATOMIC_RELAXED);
+  StoredPage *sp;
+
+  for (;;) {
+    cell = &ps->cells[pos & ps->mask];
+    size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    long dif = (long)seq - (long)(pos + 1);
+    if (dif == 0) {
+      if (__sync_bool_compare_and_swap(&ps->dequeue_pos, pos, pos + 1))
+        break;
+      pos = __atomic_load_n(&ps->dequeue_pos, __ATOMIC_RELAXED);
+    } else if (dif < 0) {
+      return NULL;  /* empty */
+    } else {
+      pos = __atomic_load_n(&ps->dequeue_pos, __ATOMIC_RELAXED);
+    }
+  }
+  sp = cell->page;
+  __atomic_store_n(&cell->seq, pos + ps->mask + 1, __ATOMIC_RELEASE);
+  return sp;
+}
+
+static size_t persist_depth(PersistStage *ps)
+{
+  return __atomic_load_n(&ps->enqueue_pos, __ATOMIC_RELAXED) -
+         __atomic_load_n(&ps->dequeue_pos, __ATOMIC_RELAXED);
+}
+
+/* --------------------------------
+   Transcoding
+
+   Writers turn pages into TRANSCODE_TO before they reach the database.
+   The charset comes from Content-Type, else from a meta tag near the top;
+   a page naming none is kept if it is valid UTF-8 and read as
+   DEFAULT_CHARSET if not. Each writer keeps its converters open. */
+
+/* Case-insensitive search for needle in the len bytes at p */
+static const char *find_nocase(const char *p, size_t len, const char *needle)
+{
+  size_t n = strlen(needle);
+  size_t i, j;
+
+  for (i = 0; i + n <= len; i++) {
+    for (j = 0; j < n; j++)
+      if (tolower((unsigned char)p[i + j]) != needle[j])
+        break;
+    if (j == n)
+      return p + i;
+  }
+  return NULL;
+}
+
+/* Copy the name after "charset=" in the len bytes at p, lower-cased */
+static int charset_parse(const char *p, size_t len, char *out, size_t size)
+{
+  const char *end = p + len;
+  const char *c = find_nocase(p, len, "charset=");
+  size_t n = 0;
+
+  if (!c)
+    return 0;
+  for (c += 8; c < end && (*c == '"' || *c == '\'' || *c == ' '); c++)
+    ;
+  while (c < end && n + 1 < size &&
+         (isalnum((unsigned char)*c) || *c == '-' || *c == '_' ||
+          *c == '.' || *c == ':'))
+    out[n++] = tolower((unsigned char)*c++);
+  out[n] = '\0';
+  return n > 0;
+}
+
+static int charset_is_utf8(const char *name)
+{
+  return !strcmp(name, "utf-8") || !strcmp(name, "utf8");
+}
+
+static int page_is_ascii(const PageBuf *page)
+{
+  const PageChunk *c;
+
+  for (c = page->head; c; c = c->next) {
+    uint64_t bits = 0, v;
+    size_t i = 0;
+
+    for (; i + 8 <= c->len; i += 8) {
+      memcpy(&v, c->data + i, 8);
+      bits |= v;
+    }
+    for (; i < c->len; i++)
+      bits |= (unsigned char)c->data[i];
+    if (bits & 0x8080808080808080ULL)
+      return 0;
+  }
+  return 1;
+}
+
+/* Strict UTF-8 check: no overlongs, surrogates or code points past
+   U+10FFFF, characters may span chunks */
+static int page_is_utf8(const PageBuf *page)
+{
+  const PageChunk *c;
+  unsigned char lo = 0x80, hi = 0xBF;
+  int need = 0;
+
+  for (c = page->head; c; c = c->next) {
+    const unsigned char *p = (const unsigned char *)c->data;
+    size_t i;
+
+    for (i = 0; i < c->len; i++) {
+      unsigned char b = p[i];
+
+      if (need) {
+        if (b < lo || b > hi)
+          return 0;
+        lo = 0x80;
+        hi = 0xBF;
+        need--;
+      }
+      else if (b < 0x80)
+        continue;
+      else if (b >= 0xC2 && b <= 0xDF)
+        need = 1;
+      else if (b >= 0xE0 && b <= 0xEF) {
+        need = 2;
+        lo = b == 0xE0 ? 0xA0 : 0x80;
+        hi = b == 0xED ? 0x9F : 0xBF;
+      }
+      else if (b >= 0xF0 && b <= 0xF4) {
+        need = 3;
+        lo = b == 0xF0 ? 0x90 : 0x80;
+        hi = b == 0xF4 ? 0x8F : 0xBF;
+      }
+      else
+        return 0;
+    }
+  }
+  return need == 0;
+}
+
+/* This writer's converter from charset, opened on first use */
+static iconv_t writer_iconv(PageWriter *w, const char *charset)
+{
+  IconvSlot *slot;
+  int i;
+
+  for (i = 0; i < w->niconv; i++)
+    if (!strcmp(w->iconv[i].name, charset)) {
+      if (w->iconv[i].cd != (iconv_t)-1)
+        iconv(w->iconv[i].cd, NULL, NULL, NULL, NULL);  /* initial state */
+      return w->iconv[i].cd;
+    }
+  if (w->niconv < ICONV_CACHE)
+    slot = &w->iconv[w->niconv++];
+  else {
+    slot = &w->iconv[w->iconv_next++ % ICONV_CACHE];
+    if (slot->cd != (iconv_t)-1)
+      iconv_close(slot->cd);
+  }
+  snprintf(slot->name, sizeof(slot->name), "%s", charset);
+  slot->cd = iconv_open(TRANSCODE_TO, charset);  /* a failure is kept too */
+  return slot->cd;
+}
+
+/* Run iconv from *ip into the tail of out, adding chunks as it fills.
+   Returns 0 once the input is used up, EILSEQ or EINVAL as iconv does, or
+   E2BIG when out has PAGE_MAX_CHUNKS full chunks. */
+static int iconv_into(iconv_t cd, char **ip, size_t *ileft, PageBuf *out)
+{
+  int full = !out->tail || out->tail->len == PAGE_CHUNK_SIZE;
+
+  while (*ileft) {
+    PageChunk *t;
+    char *op;
+    size_t oleft, r;
+
+    if (full) {
+      if (out->nchunks == PAGE_MAX_CHUNKS)
+        return E2BIG;
+      t = chunk_alloc();
+      if (out->tail)
+        out->tail->next = t;
+      else
+        out->head = t;
+      out->tail = t;
+      out->nchunks++;
+    }
+    t = out->tail;
+    op = t->data + t->len;
+    oleft = PAGE_CHUNK_SIZE - t->len;
+    r = iconv(cd, ip, ileft, &op, &oleft);
+    out->len += PAGE_CHUNK_SIZE - t->len - oleft;
+    t->len = PAGE_CHUNK_SIZE - oleft;
+    if (r == (size_t)-1) {
+      if (errno != E2BIG)
+        return errno;
+      full = 1;  /* even if a few bytes are left, the next char didn't fit */
+    }
+  }
+  return 0;
+}
+
+/* Convert in into out chunk by chunk. A character cut by a chunk boundary
+   (EINVAL) is finished in a small carry buffer; bytes that aren't valid
+   in the source charset are dropped and counted in *dropped. Returns
+   non-zero if out was cut at PAGE_MAX_CHUNKS. */
+static int page_iconv(iconv_t cd, const PageBuf *in, PageBuf *out,
+                      long *dropped)
+{
+  const PageChunk *c;
+  char carry[32];
+  size_t k = 0;  /* bytes of an unfinished character in carry */
+  int rc;
+
+  for (c = in->head; c; c = c->next) {
+    char *ip = (char *)c->data;
+    size_t ileft = c->len;
+
+    while (k) {
+      size_t take = sizeof(carry) - k;
+      char *cp = carry;
+      size_t cl, used;
+
+      if (take > ileft)
+        take = ileft;
+      memcpy(carry + k, ip, take);
+      cl = k + take;
+      rc = iconv_into(cd, &cp, &cl, out);
+      if (rc == E2BIG)
+        return 1;
+      used = k + take - cl;
+      if (used >= k) {  /* done with the carry, go on in this chunk */
+        ip += used - k;
+        ileft -= used - k;
+        k = 0;
+      }
+      else if (rc == EILSEQ) {
+        memmove(carry, carry + used + 1, k - used - 1);
+        k -= used + 1;
+        (*dropped)++;
+      }
+      else {  /* still incomplete, this chunk was too short */
+        memmove(carry, carry + used, k + take - used);
+        k += take - used;
+        ip += take;
+        ileft -= take;
+        break;
+      }
+    }
+
+    while (ileft) {
+      rc = iconv_into(cd, &ip, &ileft, out);
+      if (rc == E2BIG)
+        return 1;
+      if (rc == EINVAL && ileft < sizeof(carry)) {
+        memcpy(carry, ip, ileft);
+        k = ileft;
+        ileft = 0;
+      }
+      else if (rc) {
+        ip++;
+        ileft--;
+        (*dropped)++;
+      }
+    }
+  }
+  *dropped += k;  /* the page ended inside a character */
+  return 0;
+}
+
+/* Replace sp's body with its TRANSCODE_TO form, if it needs one.
+   Returns -1, with sp's body as it came, if that form is over
+   MAX_WEBPAGE_SIZE: a page cut short is never stored as if whole. */
+static int transcode_page(PageWriter *w, StoredPage *sp)
+{
+  long long t0 = now_us();
+  char charset[sizeof(sp->charset)];
+  PageBuf out;
+  iconv_t cd;
+  long dropped = 0;
+  int rc = 0;
+
+  snprintf(charset, sizeof(charset), "%s", sp->charset);
+  if (!charset[0] && sp->page.head)
+    charset_parse(sp->page.head->data,
+                  sp->page.head->len < CHARSET_SNIFF_BYTES ?
+                  sp->page.head->len : CHARSET_SNIFF_BYTES,
+                  charset, sizeof(charset));
+  /* gb2312 labelled pages use GBK characters; gb18030 covers both */
+  if (!strcmp(charset, "gb2312") || !strcmp(charset, "gbk") ||
+      !strcmp(charset, "x-gbk"))
+    snprintf(charset, sizeof(charset), "%s", "gb18030");
+
+  if (charset_is_utf8(charset) || page_is_ascii(&sp->page) ||
+      (!charset[0] && page_is_utf8(&sp->page))) {
+    COUNT_ADD(w->tc_skipped, 1);
+    goto done;
+  }
+  cd = writer_iconv(w, charset[0] ? charset : DEFAULT_CHARSET);
+  if (cd == (iconv_t)-1)
+    cd = writer_iconv(w, DEFAULT_CHARSET);
+  if (cd == (iconv_t)-1) {
+    COUNT_ADD(w->tc_failed, 1);
+    goto done;
+  }
+  memset(&out, 0, sizeof(PageBuf));
+  if (page_iconv(cd, &sp->page, &out, &dropped)) {
+    page_release(&out);
+    COUNT_ADD(w->tc_too_large, 1);
+    rc = -1;
+    goto done;
+  }
+  page_release(&sp->page);
+  sp->page = out;
+  COUNT_ADD(w->tc_converted, 1);
+  COUNT_ADD(w->tc_dropped, dropped);
+done:
+  COUNT_ADD(w->tc_us, now_us() - t0);
+  return rc;
+}
+
+/* --------------------------------
+   Digest index
+
+   XXH64 of every body stored, so a byte-identical page is written once
+   and later copies only get a row pointing at it by digest. The table is
+   split into DIGEST_STRIPES, each two open-addressing sets under its own
+   lock: the digests whose row is stored, and those claimed by a writer
+   whose row isn't yet. A digest moves to the first, and is appended to
+   DIGEST_FILE to be reloaded on the next start, once its row is stored. */
+
+typedef struct _DigestSet
+{
+  uint64_t *slots;            /* 0 is empty; a zero digest is stored as 1 */
+  size_t mask;
+  size_t count;
+} DigestSet;
+
+typedef struct _DigestStripe
+{
+  pthread_mutex_t lock;
+  DigestSet stored;
+  DigestSet claimed;
+  char pad[64];
+} DigestStripe;
+
+struct _DigestIndex
+{
+  DigestStripe stripes[DIGEST_STRIPES];
+  int fd;                     /* DIGEST_FILE, append only */
+  long loaded;
+};
+
+static int digest_insert(DigestSet *st, uint64_t d)
+{
+  size_t i;
+
+  if ((st->count + 1) * 4 > (st->mask + 1) * 3) {  /* keep load under 3/4 */
+    size_t n = (st->mask + 1) * 2, j;
+    uint64_t *slots = (uint64_t *)calloc(n, sizeof(uint64_t));
+
+    if (slots == NULL) {
+      fprintf(MSG_OUT, "calloc failed!\n");
+      exit (1);
+    }
+    for (j = 0; j <= st->mask; j++)
+      if (st->slots[j]) {
+        for (i = (st->slots[j] >> 6) & (n - 1); slots[i]; i = (i + 1) & (n - 1))
+          ;
+        slots[i] = st->slots[j];
+      }
+    free(st->slots);
+    st->slots = slots;
+    st->mask = n - 1;
+  }
+  for (i = (d >> 6) & st->mask; st->slots[i]; i = (i + 1) & st->mask)
+    if (st->slots[i] == d)
+      return 0;
+  st->slots[i] = d;
+  COUNT_ADD(st->count, 1);  /* under the lock, read by the stats */
+  return 1;
+}
+
+static DigestIndex *digest_open(const char *path)
+{
+  DigestIndex *di = (DigestIndex *)calloc(1, sizeof(DigestIndex));
+  uint64_t buf[4096];
+  ssize_t n;
+  int i;
+
+  if (di == NULL) {
+    fprintf(MSG_OUT, "calloc failed!\n");
+    exit (1);
+  }
+  for (i = 0; i < DIGEST_STRIPES; i++) {
+    DigestStripe *st = &di->stripes[i];
+
+    pthread_mutex_init(&st->lock, NULL);
+    st->stored.mask = 1023;
+    st->stored.slots = (uint64_t *)calloc(1024, sizeof(uint64_t));
+    st->claimed.mask = 63;
+    st->claimed.slots = (uint64_t *)calloc(64, sizeof(uint64_t));
+    if (st->stored.slots == NULL || st->claimed.slots == NULL) {
+      fprintf(MSG_OUT, "calloc failed!\n");
+      exit (1);
+    }
+  }
+  di->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+  if (di->fd == -1) {
+    perror("open(digests)");
+    return di;
+  }
+  while ((n = read(di->fd, buf, sizeof(buf))) > 0)
+    for (i = 0; i < n / 8; i++)
+      di->loaded += digest_insert(
+        &di->stripes[buf[i] & (DIGEST_STRIPES - 1)].stored, buf[i]);
+  return di;
+}
+
+static int digest_has(const DigestSet *st, uint64_t d)
+{
+  size_t i;
+
+  for (i = (d >> 6) & st->mask; st->slots[i]; i = (i + 1) & st->mask)
+    if (st->slots[i] == d)
+      return 1;
+  return 0;
+}
+
+/* Take d out of its set, shifting later entries of its run back */
+static void digest_erase(DigestSet *st, uint64_t d)
+{
+  size_t i, j, home;
+
+  for (i = (d >> 6) & st->mask; st->slots[i] != d; i = (i + 1) & st->mask)
+    if (!st->slots[i])
+      return;
+  COUNT_ADD(st->count, -1);
+  for (j = i;;) {
+    st->slots[i] = 0;
+    for (;;) {
+      j = (j + 1) & st->mask;
+      if (!st->slots[j])
+        return;
+      home = (st->slots[j] >> 6) & st->mask;
+      /* slots[j] may fill the hole unless its home lies in (i, j] */
+      if (i <= j ? (home <= i || home > j) : (home <= i && home > j))
+        break;
+    }
+    st->slots[i] = st->slots[j];
+    i = j;
+  }
+}
+
+#define DIGEST_STORED 0   /* the body is in the database: point at it */
+#define DIGEST_NEW 1      /* claimed for the body about to be stored */
+#define DIGEST_PENDING -1 /* another writer's claim: store the body too */
+
+/* What to do with a body of digest d. A claim (DIGEST_NEW) is made good
+   with digest_commit() once the row is in the database, or given back
+   with digest_drop() if it never gets there. While it is open the digest
+   isn't stored yet, so a copy can't point at it: its row might never be
+   written. */
+static int digest_claim(DigestIndex *di, uint64_t d)
+{
+  DigestStripe *st;
+  int rc;
+
+  if (!d)
+    d = 1;
+  st = &di->stripes[d & (DIGEST_STRIPES - 1)];
+  pthread_mutex_lock(&st->lock);
+  if (digest_has(&st->stored, d))
+    rc = DIGEST_STORED;
+  else if (digest_insert(&st->claimed, d))
+    rc = DIGEST_NEW;
+  else
+    rc = DIGEST_PENDING;
+  pthread_mutex_unlock(&st->lock);
+  return rc;
+}
+
+static void digest_commit(DigestIndex *di, uint64_t d)
+{
+  DigestStripe *st;
+  int added;
+
+  if (!d)
+    d = 1;
+  st = &di->stripes[d & (DIGEST_STRIPES - 1)];
+  pthread_mutex_lock(&st->lock);
+  digest_erase(&st->claimed, d);
+  added = digest_insert(&st->stored, d);
+  pthread_mutex_unlock(&st->lock);
+  if (added && di->fd != -1 && write(di->fd, &d, 8) != 8)
+    perror("write(digests)");
+}
+
+static void digest_drop(DigestIndex *di, uint64_t d)
+{
+  DigestStripe *st;
+
+  if (!d)
+    d = 1;
+  st = &di->stripes[d & (DIGEST_STRIPES - 1)];
+  pthread_mutex_lock(&st->lock);
+  digest_erase(&st->claimed, d);
+  pthread_mutex_unlock(&st->lock);
+}
+
+/* Digests of bodies stored */
+static size_t digest_count(DigestIndex *di)
+{
+  size_t n = 0;
+  int i;
+
+  for (i = 0; i < DIGEST_STRIPES; i++)
+    n += COUNT_GET(di->stripes[i].stored.count);
+  return n;
+}
+
+static void digest_close(DigestIndex *di)
+{
+  int i;
+
+  for (i = 0; i < DIGEST_STRIPES; i++) {
+    pthread_mutex_destroy(&di->stripes[i].lock);
+    free(di->stripes[i].stored.slots);
+    free(di->stripes[i].claimed.slots);
+  }
+  if (di->fd != -1)
+    close(di->fd);
+  free(di);
+}
+
+static void dead_letter(const char *url, const char *cls, int tries,
+                        const char *why);
+
+static void *writer_main(void *arg)
+{
+  PageWriter *w = (PageWriter *)arg;
+  PersistStage *ps = w->stage;
+  struct iovec iov[PAGE_MAX_CHUNKS];
+  struct timespec deadline;
+  StoredPage *sp;
+  int iovcnt, rc, i;
+
+#ifdef MYSQL_DB
+  mysql_thread_init();
+#endif
+  sink_open(&w->sink, ps->conninfo);
+  w->sink.digests = ps->digests;
+  w->sink.validators = ps->validators;
+
+  for (;;) {
+    if (w->sink.rows) {
+      /* wait for more rows, but not past the batch deadline */
+      rc = sem_timedwait(&ps->items, &deadline);
+      if (rc != 0) {
+        if (errno == ETIMEDOUT) {
+          long long t0 = now_us();
+          sink_flush(&w->sink);
+          COUNT_ADD(w->sink.put_us, now_us() - t0);
+        }
+        continue;
+      }
+    } else if (sem_wait(&ps->items) != 0) {
+      continue;
+    }
+
+    sp = persist_pop(ps);
+    if (sp == NULL) {
+      if (ps->stop)
+        break;
+      continue;
+    }
+    long lag = (long)(now_ms() - sp->queued_ms);
+    __atomic_store_n(&w->lag_ms, lag, __ATOMIC_RELAXED);
+    COUNT_MAX(w->lag_max_ms, lag);
+
+    if (!w->sink.rows) {
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += BATCH_FLUSH_MS / 1000;
+      deadline.tv_nsec += (BATCH_FLUSH_MS % 1000) * 1000000L;
+      if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+      }
+    }
+    int dup = 0;
+    if (sp->url && sp->page.len >= DEDUP_MIN_BYTES) {
+      COUNT_ADD(w->dedup_checked, 1);
+      int claim = digest_claim(ps->digests, sp->digest);
+      sp->claimed = claim == DIGEST_NEW;
+      dup = claim == DIGEST_STORED;
+    }
+    if (dup) {
+      COUNT_ADD(w->dedup_hits, 1);
+      COUNT_ADD(w->dedup_saved, sp->page.len);
+      page_release(&sp->page);
+    } else if (!sp->encoded &&  /* gzip kept as received isn't text */
+               transcode_page(w, sp) < 0) {
+      /* given up on like a page too large as received */
+      if (sp->url) {
+        char why[64];
+
+        snprintf(why, sizeof(why), "page over %d bytes as %s",
+                 MAX_WEBPAGE_SIZE, TRANSCODE_TO);
+        dead_letter(sp->url, "too_large", sp->tries, why);
+        if (ps->seen)
+          seen_forget(ps->seen, sp->url, (unsigned int)(time(NULL) / 60));
+      }
+      sink_done(&w->sink, sp, 0);
+      continue;
+    }
+    iovcnt = page_iov(&sp->page, iov, PAGE_MAX_CHUNKS);
+    long long t0 = now_us();
+    sink_put(&w->sink, sp, dup ? NULL : iov, iovcnt, sp->page.len);
+    COUNT_ADD(w->sink.put_us, now_us() - t0);
+  }
+
+  sink_close(&w->sink);
+  for (i = 0; i < w->niconv; i++)
+    if (w->iconv[i].cd != (iconv_t)-1)
+      iconv_close(w->iconv[i].cd);
+#ifdef MYSQL_DB
+  mysql_thread_end();
+#endif
+  return NULL;
+}
+
+static PersistStage *persist_start(const char *conninfo,
+                                   ValidatorStore *validators,
+                                   struct _SeenFilter *seen, int nwriters)
+{
+  PersistStage *ps = (PersistStage *)calloc(1, sizeof(PersistStage));
+  size_t i;
+
+  if (ps == NULL) {
+    fprintf(MSG_OUT, "calloc failed!\n");
+    exit (1);
+  }
+  ps->cells = (PageQueueCell *)calloc(PERSIST_QUEUE_SIZE, sizeof(PageQueueCell));
+  ps->writers = (PageWriter *)calloc(nwriters, sizeof(PageWriter));
+  if (ps->cells == NULL || ps->writers == NULL) {
+    fprintf(MSG_OUT, "calloc failed!\n");
+    exit (1);
+  }
+  ps->mask = PERSIST_QUEUE_SIZE - 1;
+  for (i = 0; i < PERSIST_QUEUE_SIZE; i++)
+    ps->cells[i].seq = i;
+  sem_init(&ps->items, 0, 0);
+  ps->conninfo = conninfo;
+  ps->validators = validators;
+  ps->seen = seen;
+  ps->digests = digest_open(DIGEST_FILE);
+  fprintf(MSG_OUT, "%ld digests loaded from %s\n", ps->digests->loaded,
+          DIGEST_FILE);
+  ps->nwriters = nwriters;
+
+#ifdef MYSQL_DB
+  mysql_library_init(0, NULL, NULL);
+#endif
+  for (i = 0; i < (size_t)nwriters; i++) {
+    ps->writers[i].stage = ps;
+    if (pthread_create(&ps->writers[i].tid, NULL, writer_main, &ps->writers[i])) {
+      perror("pthread_create");
+      exit (1);
+    }
+  }
+  return ps;
+}
+
+/* Let the writers drain the queue, then wait for them */
+static void persist_stop(PersistStage *ps)
+{
+  int i;
+
+  ps->stop = 1;
+  for (i = 0; i < ps->nwriters; i++)
+    sem_post(&ps->items);
+  for (i = 0; i < ps->nwriters; i++)
+    pthread_join(ps->writers[i].tid, NULL);
+  sem_destroy(&ps->items);
+  digest_close(ps->digests);
+  free(ps->writers);
+  free(ps->cells);
+  free(ps);
+}
+
+/* Hand a finished page to the writers.  The chunks move with it, so page
+   is left empty.  A full queue pushes back on the loop.  etag and lm are
+   recorded once the row is stored; a NULL etag records nothing. */
+static void store_page(GlobalInfo *g, PageBuf *page, unsigned long size,
+                       const char *content_type, const char *url,
+                       uint64_t digest, int encoded, int tries,
+                       const char *etag, long long lm)
+{
+  StoredPage *sp = (StoredPage *)malloc(sizeof(StoredPage));
+
+  if (sp == NULL) {
+    fprintf(MSG_OUT, "malloc failed!\n");
+    exit (1);
+  }
+  sp->page = *page;
+  sp->size = size;
+  sp->queued_ms = now_ms();
+  sp->url = url ? strdup(url) : NULL;
+  sp->digest = digest;
+  sp->encoded = encoded;
+  sp->tries = tries;
+  sp->claimed = 0;
+  sp->etag = url && etag ? strdup(etag) : NULL;
+  sp->last_modified = lm;
+  sp->charset[0] = '\0';
+  if (content_type)
+    charset_parse(content_type, strlen(content_type), sp->charset,
+                  sizeof(sp->charset));
+  memset(page, 0, sizeof(PageBuf));
+
+  if (!persist_push(g->persist, sp)) {
+    __atomic_add_fetch(&g->persist->stalls, 1, __ATOMIC_RELAXED); /* any shard */
+    while (!persist_push(g->persist, sp))
+      sched_yield();
+  }
+}
+
+
+static void conn_put(GlobalInfo *g, ConnInfo *conn);
+static void host_bytes_add(GlobalInfo *g, const char *url, long long wire,
+                           long long decoded);
+static void start_pending(GlobalInfo *g);
+static void sched_done(GlobalInfo *g, HostQueue *hq);
+static int retry_check(GlobalInfo *g, ConnInfo *conn, CURLcode res,
+                       long code);
+static void fifo_check_resume(GlobalInfo *g);
+
+/* --------------------------------
+   Deadlines
+
+   A transfer is given up on when it isn't connected after
+   CONNECT_TIMEOUT_MS (curl's own connect timeout), has no response
+   FIRST_BYTE_TIMEOUT_MS after curl gave it a connection, receives less
+   than LOW_SPEED_BYTES in a LOW_SPEED_MS window, or runs past
+   TOTAL_TIMEOUT_MS from when it was handed to curl. Up to
+   HOST_MAX_IN_FLIGHT transfers per host may wait inside curl for one of
+   MAX_HOST_CONNECTIONS, or for a stream, and only the total deadline
+   runs while they do. The callbacks only note what arrived and
+   when; transfers sit in a min-heap by the next time one of their
+   deadlines could pass, behind one loop timer, and are looked at only
+   then. A reaped transfer ends as a timeout, so the retry policy decides
+   whether it is queued again. */
+
+static void deadline_swap(GlobalInfo *g, int a, int b)
+{
+  ConnInfo *t = g->deadline_heap[a];
+
+  g->deadline_heap[a] = g->deadline_heap[b];
+  g->deadline_heap[b] = t;
+  g->deadline_heap[a]->deadline_idx = a;
+  g->deadline_heap[b]->deadline_idx = b;
+}
+
+static void deadline_up(GlobalInfo *g, int i)
+{
+  for (; i > 0 && g->deadline_heap[(i - 1) / 2]->deadline_us >
+       g->deadline_heap[i]->deadline_us; i = (i - 1) / 2)
+    deadline_swap(g, i, (i - 1) / 2);
+}
+
+static void deadline_down(GlobalInfo *g, int i)
+{
+  int c;
+
+  while ((c = 2 * i + 1) < g->deadline_len) {
+    if (c + 1 < g->deadline_len && g->deadline_heap[c + 1]->deadline_us <
+        g->deadline_heap[c]->deadline_us)
+      c++;
+    if (g->deadline_heap[i]->deadline_us <= g->deadline_heap[c]->deadline_us)
+      break;
+    deadline_swap(g, i, c);
+    i = c;
+  }
+}
+
+static void deadline_add(GlobalInfo *g, ConnInfo *conn)
+{
+  if (g->deadline_len == g->deadline_size) {
+    g->deadline_size = g->deadline_size ? g->deadline_size * 2 : 64;
+    g->deadline_heap = (ConnInfo **)realloc(g->deadline_heap,
+                                            g->deadline_size *
+                                            sizeof(ConnInfo *));
+    if (g->deadline_heap == NULL) {
+      fprintf(MSG_OUT, "realloc failed!\n");
+      exit (1);
+    }
+  }
+  conn->deadline_idx = g->deadline_len++;
+  g->deadline_heap[conn->deadline_idx] = conn;
+  deadline_up(g, conn->deadline_idx);
+}
+
+static void deadline_del(GlobalInfo *g, ConnInfo *conn)
+{
+  int i = conn->deadline_idx;
+
+  if (i < 0)
+    return;
+  conn->deadline_idx = -1;
+  if (i == --g->deadline_len)
+    return;
+  g->deadline_heap[i] = g->deadline_heap[g->deadline_len];
+  g->deadline_heap[i]->deadline_idx = i;
+  deadline_up(g, i);
+  deadline_down(g, i);
+}
+
+/* Point the timer at the first deadline */
+static void deadline_arm(GlobalInfo *g, long long now)
+{
+  long long ms;
+
+  if (!g->deadline_len) {
+    watch_timer(g->deadline_event, -1);
+    return;
+  }
+  ms = (g->deadline_heap[0]->deadline_us - now + 999) / 1000;
+  watch_timer(g->deadline_event, ms > 0 ? (long)ms : 0);
+}
+
+/* Where the first low-speed window starts: at the first byte, or at the
+   connection when there is no first-byte deadline to wait for it */
+static long long deadline_window(const ConnInfo *conn)
+{
+  return conn->first_rx_us ? conn->first_rx_us : conn->connected_us;
+}
+
+/* When to look at a transfer next, 0 for never */
+static long long deadline_next(const ConnInfo *conn)
+{
+  long long d = 0, total = conn->start_us + TOTAL_TIMEOUT_MS * 1000LL;
+
+  if (!conn->connected_us)
+    ;  /* waiting for a connection: only the total runs */
+  else if (!conn->first_rx_us && FIRST_BYTE_TIMEOUT_MS)
+    d = conn->connected_us + FIRST_BYTE_TIMEOUT_MS * 1000LL;
+  else if (LOW_SPEED_MS)
+    d = (conn->window_us ? conn->window_us : deadline_window(conn)) +
+        LOW_SPEED_MS * 1000LL;
+  if (TOTAL_TIMEOUT_MS > 0 && (!d || total < d))
+    d = total;
+  return d;
+}
+
+/* The deadline a transfer has missed by now, or -1 */
+static int deadline_check(ConnInfo *conn, long long now)
+{
+  if (TOTAL_TIMEOUT_MS > 0 &&
+      now >= conn->start_us + TOTAL_TIMEOUT_MS * 1000LL)
+    return REAP_TOTAL;
+  if (!conn->connected_us)
+    return -1;
+  if (!conn->first_rx_us && FIRST_BYTE_TIMEOUT_MS)
+    return now >= conn->connected_us + FIRST_BYTE_TIMEOUT_MS * 1000LL ?
+           REAP_FIRST_BYTE : -1;
+  if (LOW_SPEED_MS) {
+    if (!conn->window_us) {
+      conn->window_us = deadline_window(conn);
+      conn->window_rx = 0;
+    }
+    if (now >= conn->window_us + LOW_SPEED_MS * 1000LL) {
+      if (conn->rx_bytes - conn->window_rx < LOW_SPEED_BYTES)
+        return REAP_LOW_SPEED;
+      conn->window_us = now;
+      conn->window_rx = conn->rx_bytes;
+    }
+  }
+  return -1;
+}
+
+/* conn's deadlines moved: put it back in order, or in or out of the heap */
+static void deadline_move(GlobalInfo *g, ConnInfo *conn, long long now)
+{
+  conn->deadline_us = deadline_next(conn);
+  if (!conn->deadline_us)
+    deadline_del(g, conn);
+  else if (conn->deadline_idx < 0)
+    deadline_add(g, conn);
+  else {
+    deadline_up(g, conn->deadline_idx);
+    deadline_down(g, conn->deadline_idx);
+  }
+  deadline_arm(g, now);
+}
+
+/* Bookkeeping and storing for a finished transfer; gives conn back */
+static void transfer_done(GlobalInfo *g, ConnInfo *conn, CURLcode res)
+{
+  CURL *easy = conn->easy;
+
+  deadline_del(g, conn);
+  if (res == CURLE_OPERATION_TIMEDOUT) {
+    long long now = now_us();
+
+    /* ours, or curl's connect timeout, the only one it is given */
+    COUNT_ADD(g->reaped[conn->reaped >= 0 ? conn->reaped : REAP_CONNECT], 1);
+    hist_add(&g->reap_stall, now - (conn->last_rx_us ? conn->last_rx_us :
+                                    conn->start_us));
+  }
+  curl_off_t wire = 0;
+  curl_easy_getinfo(easy, CURLINFO_SIZE_DOWNLOAD_T, &wire);
+  host_bytes_add(g, conn->url, wire, conn->page.len);
+  long connects = 0, version = 0;
+  curl_easy_getinfo(easy, CURLINFO_NUM_CONNECTS, &connects);
+  curl_easy_getinfo(easy, CURLINFO_HTTP_VERSION, &version);
+  COUNT_ADD(g->connects, connects);
+  curl_off_t appconnect = 0;
+  curl_easy_getinfo(easy, CURLINFO_APPCONNECT_TIME_T, &appconnect);
+  if (connects && appconnect) {  /* this transfer did a TLS handshake */
+    if (conn->tls_reused == 3)
+      COUNT_ADD(g->tls_resumed, 1);
+    else
+      COUNT_ADD(g->tls_full, 1);
+  }
+  COUNT_ADD(g->h2_pages, version == CURL_HTTP_VERSION_2_0);
+
+  long code = 0, unmet = 0;
+  curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &code);
+  curl_easy_getinfo(easy, CURLINFO_CONDITION_UNMET, &unmet);
+  if (conn->conditional && (code == 304 || unmet)) {
+    /* our copy is current: no body, no row.  curl also drops the body
+       of a 200 whose Last-Modified doesn't meet the condition */
+    COUNT_ADD(g->not_modified, 1);
+    COUNT_ADD(g->nm_bytes, conn->cond_size);
+    if (g->seen)
+      seen_mark(g->seen, conn->url, (unsigned int)(time(NULL) / 60));
+  }
+  else if (retry_check(g, conn, res, code))
+    ;  /* failed: queued again after a backoff, or given up on */
+  else {
+    char *ctype = NULL;
+    curl_easy_getinfo(easy, CURLINFO_CONTENT_TYPE, &ctype);
+    if (g->seen && res == CURLE_OK && code >= 200 && code < 300)
+      seen_mark(g->seen, conn->url, (unsigned int)(time(NULL) / 60));
+    else if (g->seen)
+      seen_release(g->seen, conn->url);
+    /* the validators wait for the row: see sink_done() */
+    int full = res == CURLE_OK && code == 200;
+    store_page(g, &conn->page, conn->page.len, ctype, conn->url,
+               xxh64_digest(&conn->hash), STORE_ENCODED && conn->encoded,
+               conn->attempt + 1, full ? conn->etag : NULL,
+               conn->last_modified);
+  }
+
+  curl_multi_remove_handle(g->multi, easy);
+  hist_add(&g->lane_done[conn->lane], now_us() - conn->queued_us);
+  sched_done(g, conn->hq);
+  conn_put(g, conn);
+  COUNT_ADD(g->in_flight, -1);
+  COUNT_ADD(g->completed, 1);
+}
+
+/* Check for completed transfers, and remove their easy handles */
+static void check_multi_info(GlobalInfo *g)
+{
+  char *eff_url;
+  CURLMsg *msg;
+  int msgs_left;
+  ConnInfo *conn;
+  CURL *easy;
+  CURLcode res;
+
+#ifdef DEBUG
+  fprintf(MSG_OUT, "REMAINING: %d\n", g->still_running);
+#endif
+
+  while ((msg = curl_multi_info_read(g->multi, &msgs_left))) {
+    if (msg->msg == CURLMSG_DONE) {
+		// ------------------
+      easy = msg->easy_handle;
+      res = msg->data.result;
+      curl_easy_getinfo(easy, CURLINFO_PRIVATE, &conn);
+      curl_easy_getinfo(easy, CURLINFO_EFFECTIVE_URL, &eff_url);
+#ifdef DEBUG
+      fprintf(MSG_OUT, "DONE: %s => (%d) %s\n", eff_url, res, conn->error);
+#endif
+      transfer_done(g, conn, res);
+    }
+  }
+  /* refill the slots that just freed up */
+  start_pending(g);
+  fifo_check_resume(g);
+}
+
+/* Reap the transfers whose deadlines passed */
+static void deadline_cb(int fd, short kind, void *userp)
+{
+  static const char *const why[REAP_REASONS] =
+    {"connect", "no first byte", "too slow", "total time"};
+  GlobalInfo *g = (GlobalInfo *)userp;
+  long long now = now_us();
+  ConnInfo *conn;
+  int reason;
+  (void)fd;
+  (void)kind;
+
+  while (g->deadline_len && (conn = g->deadline_heap[0])->deadline_us <= now) {
+    reason = deadline_check(conn, now);
+    if (reason < 0) {
+      conn->deadline_us = deadline_next(conn);
+      if (conn->deadline_us)
+        deadline_down(g, 0);
+      else
+        deadline_del(g, conn);
+      continue;
+    }
+    conn->reaped = reason;
+    snprintf(conn->error, CURL_ERROR_SIZE, "reaped: %s after %lld ms",
+             why[reason], (now - conn->start_us) / 1000);
+    transfer_done(g, conn, CURLE_OPERATION_TIMEDOUT);
+  }
+  deadline_arm(g, now);
+  start_pending(g);
+  fifo_check_resume(g);
+}
+
+
+
+/* Called by the event loop when we get action on a multi socket */
+static void event_cb(int fd, short kind, void *userp)
+{
+  GlobalInfo *g = (GlobalInfo*) userp;
+  CURLMcode rc;
+
+  int action =
+    (kind & WATCH_READ ? CURL_CSELECT_IN : 0) |
+    (kind & WATCH_WRITE ? CURL_CSELECT_OUT : 0);
+
+  rc = curl_multi_socket_action(g->multi, fd, action, &g->still_running);
+  mcode_or_die("event_cb: curl_multi_socket_action", rc);
+
+  check_multi_info(g);
+  if ( g->still_running <= 0 ) {
+#ifdef DEBUG
+    fprintf(MSG_OUT, "last transfer done, kill timeout\n");
+#endif
+    watch_timer(g->timer_event, -1);
+  }
+}
+
+
+
+/* Called by the event loop when our timeout expires */
+static void timer_cb(int fd, short kind, void *userp)
+{
+  GlobalInfo *g = (GlobalInfo *)userp;
+  CURLMcode rc;
+  (void)fd;
+  (void)kind;
+
+  rc = curl_multi_socket_action(g->multi,
+                                  CURL_SOCKET_TIMEOUT, 0, &g->still_running);
+  mcode_or_die("timer_cb: curl_multi_socket_action", rc);
+  check_multi_info(g);
+}
+
+
+
+/* Stop watching the socket and keep the SockInfo for the next one */
+static void remsock(SockInfo *f)
+{
+  GlobalInfo *g;
+
+  if (!f)
+    return;
+  g = f->global;
+  watch_io(f->ev, 0);
+  if (g->sock_pool_len >= SOCK_POOL_MAX) {
+    watch_free(f->ev);
+    free(f);
+    return;
+  }
+  f->next = g->sock_pool;
+  g->sock_pool = f;
+  g->sock_pool_len++;
+}
+
+static void sock_pool_free(GlobalInfo *g)
+{
+  SockInfo *f;
+
+  while ((f = g->sock_pool)) {
+    g->sock_pool = f->next;
+    watch_free(f->ev);
+    free(f);
+  }
+  g->sock_pool_len = 0;
+}
+
+
+
+/* Assign information to a SockInfo structure; the watcher is re-armed in
+   place, so a change from IN to OUT is a single epoll_ctl(MOD) */
+static void setsock(SockInfo*f, curl_socket_t s, CURL*e, int act, GlobalInfo*g)
+{
+  int kind =
+     (act&CURL_POLL_IN?WATCH_READ:0)|(act&CURL_POLL_OUT?WATCH_WRITE:0);
+
+  f->sockfd = s;
+  f->action = act;
+  f->easy = e;
+  if (kind == f->ev->kind) {
+    COUNT_ADD(g->sock_same, 1);
+    return;
+  }
+  if (f->ev->kind)
+    COUNT_ADD(g->sock_changes, 1);
+  watch_io(f->ev, kind);
+}
+
+
+
+/* Take a SockInfo from the pool, or make one */
+static void addsock(curl_socket_t s, CURL *easy, int action, GlobalInfo *g)
+{
+  SockInfo *fdp = g->sock_pool;
+
+  if (fdp) {
+    g->sock_pool = fdp->next;
+    g->sock_pool_len--;
+  }
+  else {
+    fdp = (SockInfo *)calloc(sizeof(SockInfo), 1);
+    if (fdp == NULL) {
+      fprintf(MSG_OUT, "calloc failed!\n");
+      exit (1);
+    }
+    fdp->global = g;
+    fdp->ev = watch_new(g->loop, s, event_cb, g);
+    COUNT_ADD(g->sock_allocs, 1);
+  }
+  COUNT_ADD(g->sock_new, 1);
+  fdp->ev->fd = s;  /* the watcher is idle, so it can change fd */
+  setsock(fdp, s, easy, action, g);
+  curl_multi_assign(g->multi, s, fdp);
+}
+
+/* CURLMOPT_SOCKETFUNCTION */
+static int sock_cb(CURL *e, curl_socket_t s, int what, void *cbp, void *sockp)
+{
+  GlobalInfo *g = (GlobalInfo*) cbp;
+  SockInfo *fdp = (SockInfo*) sockp;
+
+#ifdef DEBUG
+  const char *whatstr[]={ "none", "IN", "OUT", "INOUT", "REMOVE" };
+  fprintf(MSG_OUT,
+          "socket callback: s=%d e=%p what=%s ", s, e, whatstr[what]);
+#endif
+
+  if (what == CURL_POLL_REMOVE) {
+#ifdef DEBUG
+    fprintf(MSG_OUT, "\n");
+#endif
+    remsock(fdp);
+  }
+  else {
+    if (!fdp) {
+#ifdef DEBUG
+      fprintf(MSG_OUT, "Adding data: %s\n", whatstr[what]);
+#endif
+      addsock(s, e, what, g);
+    }
+    else {
+#ifdef DEBUG
+      fprintf(MSG_OUT,
+              "Changing action from %s to %s\n",
+              whatstr[fdp->action], whatstr[what]);
+#endif
+      setsock(fdp, s, e, what, g);
+    }
+  }
+  return 0;
+}
+
+
+
+/* CURLOPT_WRITEFUNCTION */
+/* Note bytes received, for the deadlines */
+static inline void conn_rx(ConnInfo *conn, size_t len)
+{
+  conn->last_rx_us = now_us();
+  if (!conn->first_rx_us)
+    conn->first_rx_us = conn->last_rx_us;
+  conn->rx_bytes += len;
+}
+
+static size_t write_cb(void *ptr, size_t size, size_t nmemb, void *data)
+{
+  size_t realsize = size * nmemb;
+  ConnInfo *conn = (ConnInfo*) data;
+  (void)ptr;
+  (void)conn;
+
+  //CURLcode res;
+  //double filesize;
+  //time_t filetime;
+ /* res = curl_easy_getinfo(conn->easy, CURLINFO_FILETIME, &filetime);
+  if((CURLE_OK == res) && filetime)
+        printf("filetime %s", ctime(&filetime));
+*/
+  /*res = curl_easy_getinfo(conn->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &filesize);
+  if((CURLE_OK == res) && filesize)
+        printf("filesize: %0.0f bytes\n", filesize);
+	*/
+
+  // ------------------
+  if (conn->page.len + realsize > MAX_WEBPAGE_SIZE) {
+    /* abort the transfer rather than keep growing; dead-lettered, a
+       cut page isn't stored */
+    conn->truncated = 1;
+    return 0;
+  }
+  page_append(&conn->page, (const char *)ptr, realsize);
+  xxh64_update(&conn->hash, ptr, realsize);
+  conn_rx(conn, realsize);
+  return realsize;
+  /*
+  // ------------------
+  char substr[102400] = {'\0'};
+  strncpy(substr, (const char*)ptr, realsize);
 
   //printf("body: %s\n", substr);  
   //return realsize;
 
-  //mysql_real_escape_string(g_pConn, substr, (const char*)substr, realsize);
-  //printf("body: %s\n", substr); 
-  
-  // -------------------
-  char query[102400], *end;
-  end = strmov(query, "INSERT INTO writers VALUES(");
-  *end++ = '\'';
-  end += mysql_real_escape_string(g_pConn, end, (const char*)substr, realsize);
-  *end++ = '\'';
-  *end++ = ')';
-  printf("sql: %s\n", query);
+  //mysql_real_escape_string(g_pConn, substr, (const char*)substr, realsize);
+  //printf("body: %s\n", substr); 
+  
+  // -------------------
+  char query[102400], *end;
+  end = strmov(query, "INSERT INTO writers VALUES(");
+  *end++ = '\'';
+  end += mysql_real_escape_string(g_pConn, end, (const char*)substr, realsize);
+  *end++ = '\'';
+  *end++ = ')';
+  printf("sql: %s\n", query);
+
+  if (mysql_real_query(g_pConn, query, (unsigned int) (end - query)))
+  {
+	  fprintf(stderr, "Failed to insert row, Error: %s\n",
+		  mysql_error(g_pConn));
+  }
+return realsize;
+
+  //strncpy(szBuf, (const char*)ptr, size*nmemb);
+  //szBuf = substr(szBuf,0,realsize+1)
+  //sprintf(szBuf, "INSERT INTO writers VALUES('%s')", szBuf);
+  //printf("sql: %s\n", szBuf);
+  //mysql_query(g_pConn, szBuf);
+  return realsize;*/
+}
+
+
+/* CURLOPT_HEADERFUNCTION: keep the validators of the last response, so a
+   redirect's own ETag doesn't stick to the page */
+static size_t header_cb(char *ptr, size_t size, size_t nmemb, void *data)
+{
+  size_t len = size * nmemb, nlen, vlen;
+  ConnInfo *conn = (ConnInfo *)data;
+  const char *v, *end = ptr + len;
+
+  conn_rx(conn, len);
+  if (len > 5 && !strncmp(ptr, "HTTP/", 5)) {
+    conn->etag[0] = '\0';
+    conn->last_modified = 0;
+    conn->encoded = 0;
+    conn->retry_after_ms = 0;
+    if (!conn->tls_reused) {
+      /* the connection is gone by the time the transfer is done */
+      conn->tls_reused = 1;
+#ifdef HAVE_OPENSSL
+      struct curl_tlssessioninfo *tsi = NULL;
+      if (curl_easy_getinfo(conn->easy, CURLINFO_TLS_SSL_PTR, &tsi) ==
+          CURLE_OK && tsi && tsi->backend == CURLSSLBACKEND_OPENSSL &&
+          tsi->internals)
+        conn->tls_reused = SSL_session_reused((SSL *)tsi->internals) ? 3 : 2;
+#endif
+    }
+    return len;
+  }
+  v = (const char *)memchr(ptr, ':', len);
+  if (!v)
+    return len;
+  nlen = v - ptr;
+  for (v++; v < end && (*v == ' ' || *v == '\t'); v++)
+    ;
+  while (end > v && (end[-1] == '\r' || end[-1] == '\n' || end[-1] == ' '))
+    end--;
+  vlen = end - v;
+  if (nlen == 4 && !strncasecmp(ptr, "etag", 4)) {
+    if (vlen < sizeof(conn->etag)) {
+      memcpy(conn->etag, v, vlen);
+      conn->etag[vlen] = '\0';
+    }
+    else
+      conn->etag[0] = '\0';
+  }
+  else if (nlen == 13 && !strncasecmp(ptr, "last-modified", 13) && vlen < 64) {
+    char date[64];
+    time_t t;
+
+    memcpy(date, v, vlen);
+    date[vlen] = '\0';
+    t = curl_getdate(date, NULL);
+    conn->last_modified = t > 0 ? t : 0;
+  }
+  else if (nlen == 16 && !strncasecmp(ptr, "content-encoding", 16))
+    conn->encoded = vlen && !(vlen == 8 && !strncasecmp(v, "identity", 8));
+  else if (nlen == 11 && !strncasecmp(ptr, "retry-after", 11) && vlen &&
+           vlen < 64) {
+    char date[64];
+    long secs;
+
+    memcpy(date, v, vlen);
+    date[vlen] = '\0';
+    if (*date >= '0' && *date <= '9')  /* seconds, or an HTTP date */
+      secs = strtol(date, NULL, 10);
+    else {
+      time_t t = curl_getdate(date, NULL);
+      secs = t > 0 ? (long)(t - time(NULL)) : 0;
+    }
+    conn->retry_after_ms = secs <= 0 ? 0 : secs > RETRY_MAX_MS / 1000 ?
+                           RETRY_MAX_MS + 1L : secs * 1000;
+  }
+  return len;
+}
+
+
+/* CURLOPT_PREREQFUNCTION: the transfer has its connection, new or reused,
+   and the request is about to go out; the first-byte clock starts now */
+static int prereq_cb(void *p, char *primary_ip, char *local_ip,
+                     int primary_port, int local_port)
+{
+  ConnInfo *conn = (ConnInfo *)p;
+  (void)primary_ip;
+  (void)local_ip;
+  (void)primary_port;
+  (void)local_port;
+
+  if (!conn->connected_us) {
+    long long now = now_us();
+
+    conn->connected_us = now;
+    deadline_move(conn->global, conn, now);
+  }
+  return CURL_PREREQFUNC_OK;
+}
+
+/* CURLOPT_PROGRESSFUNCTION */
+static int prog_cb (void *p, double dltotal, double dlnow, double ult,
+                    double uln)
+{
+  ConnInfo *conn = (ConnInfo *)p;
+  (void)ult;
+  (void)uln;
+
+  fprintf(MSG_OUT, "Progress: %s (%g/%g)\n", conn->url, dlnow, dltotal);
+  return 0;
+}
+
+
+/* Take a ConnInfo from the pool, or build a new one.  The options that do
+   not change between URLs are only set when the easy handle is created. */
+static ConnInfo *conn_get(GlobalInfo *g)
+{
+  ConnInfo *conn = g->conn_pool;
+
+  if (conn) {
+    g->conn_pool = conn->next;
+    g->conn_pool_len--;
+    conn->next = NULL;
+    conn->error[0] = '\0';
+    return conn;
+  }
+
+  conn = (ConnInfo *)calloc(1, sizeof(ConnInfo));
+  if (conn == NULL) {
+	  fprintf(MSG_OUT, "calloc failed!\n");
+	  exit (1);
+  }
+
+  conn->easy = curl_easy_init();
+  if (!conn->easy) {
+    fprintf(MSG_OUT, "curl_easy_init() failed, exiting!\n");
+    exit(2);
+  }
+  conn->global = g;
+  conn->deadline_idx = -1;
+  curl_easy_setopt(conn->easy, CURLOPT_WRITEFUNCTION, write_cb);
+  curl_easy_setopt(conn->easy, CURLOPT_WRITEDATA, conn);
+  //curl_easy_setopt(conn->easy, CURLOPT_VERBOSE, 1L);
+  curl_easy_setopt(conn->easy, CURLOPT_ERRORBUFFER, conn->error);
+  curl_easy_setopt(conn->easy, CURLOPT_PRIVATE, conn);
+  curl_easy_setopt(conn->easy, CURLOPT_DNS_CACHE_TIMEOUT, (long)DNS_CACHE_SECONDS);
+  curl_easy_setopt(conn->easy, CURLOPT_CONNECTTIMEOUT_MS,
+                   (long)CONNECT_TIMEOUT_MS);
+  /* decoded by curl as it arrives, write_cb only ever sees plain bytes */
+  curl_easy_setopt(conn->easy, CURLOPT_ACCEPT_ENCODING,
+                   STORE_ENCODED ? "gzip" : ACCEPT_ENCODING);
+  curl_easy_setopt(conn->easy, CURLOPT_HTTP_CONTENT_DECODING,
+                   STORE_ENCODED ? 0L : 1L);
+  curl_easy_setopt(conn->easy, CURLOPT_HTTP_VERSION,
+                   HTTP2 ? (long)CURL_HTTP_VERSION_2TLS :
+                   (long)CURL_HTTP_VERSION_1_1);
+  /* wait for a stream on a connection being set up instead of opening
+     another one; curl keeps such transfers queued per host */
+  curl_easy_setopt(conn->easy, CURLOPT_PIPEWAIT, HTTP2 ? 1L : 0L);
+  curl_easy_setopt(conn->easy, CURLOPT_SHARE, g->share);
+  //curl_easy_setopt(conn->easy, CURLOPT_NOPROGRESS, 0L);
+  //curl_easy_setopt(conn->easy, CURLOPT_PROGRESSFUNCTION, prog_cb);
+  //curl_easy_setopt(conn->easy, CURLOPT_PROGRESSDATA, conn);
+  curl_easy_setopt(conn->easy, CURLOPT_HEADERFUNCTION, header_cb);
+  curl_easy_setopt(conn->easy, CURLOPT_HEADERDATA, conn);
+  curl_easy_setopt(conn->easy, CURLOPT_PREREQFUNCTION, prereq_cb);
+  curl_easy_setopt(conn->easy, CURLOPT_PREREQDATA, conn);
+  return conn;
+}
+
+/* Destroy a ConnInfo and its easy handle */
+static void conn_free(ConnInfo *conn)
+{
+  curl_easy_cleanup(conn->easy);
+  curl_slist_free_all(conn->cond_headers);
+  free(conn->url);
+  free(conn);
+}
+
+/* Give a finished ConnInfo back to the pool.  The easy handle must already
+   be removed from the multi handle; it keeps its options, so the next URL
+   only has to set CURLOPT_URL. */
+static void conn_put(GlobalInfo *g, ConnInfo *conn)
+{
+  page_release(&conn->page);
+  curl_slist_free_all(conn->cond_headers);
+  conn->cond_headers = NULL;
+  if (g->conn_pool_len >= CONN_POOL_MAX) {
+    conn_free(conn);
+    return;
+  }
+  conn->next = g->conn_pool;
+  g->conn_pool = conn;
+  g->conn_pool_len++;
+}
+
+static void conn_pool_free(GlobalInfo *g)
+{
+  ConnInfo *conn;
+
+  while ((conn = g->conn_pool)) {
+    g->conn_pool = conn->next;
+    conn_free(conn);
+  }
+  g->conn_pool_len = 0;
+}
+
+/* Add an easy handle for a queued URL to the global curl_multi */
+static void new_conn(PendingUrl *p, GlobalInfo *g, HostQueue *hq)
+{
+  ConnInfo *conn;
+  CURLMcode rc;
+  char *url = p->url;
+  size_t len = p->len + 1;
+
+  conn = conn_get(g);
+  if (len > conn->url_size) {
+    free(conn->url);
+    conn->url = (char *)malloc(len);
+    if (conn->url == NULL) {
+      fprintf(MSG_OUT, "malloc failed!\n");
+      exit (1);
+    }
+    conn->url_size = len;
+  }
+  memcpy(conn->url, url, len);
+  conn->hq = hq;
+  conn->lane = p->lane;
+  conn->attempt = p->attempt;
+  conn->queued_us = p->queued_us;
+  conn->retry_after_ms = 0;
+  conn->truncated = 0;
+  curl_easy_setopt(conn->easy, CURLOPT_URL, conn->url);
+  xxh64_reset(&conn->hash, 0);
+
+  /* a pooled handle still has the last URL's conditions, always reset */
+  conn->etag[0] = '\0';
+  conn->last_modified = 0;
+  conn->tls_reused = 0;
+  conn->conditional = validators_get(g->validators, url, conn->etag,
+                                     &conn->last_modified, &conn->cond_size);
+  if (conn->conditional && conn->etag[0]) {
+    char line[VALIDATOR_ETAG_MAX + 16];
+
+    snprintf(line, sizeof(line), "If-None-Match: %s", conn->etag);
+    conn->cond_headers = curl_slist_append(NULL, line);
+  }
+  curl_easy_setopt(conn->easy, CURLOPT_HTTPHEADER, conn->cond_headers);
+  curl_easy_setopt(conn->easy, CURLOPT_TIMECONDITION, conn->last_modified ?
+                   (long)CURL_TIMECOND_IFMODSINCE : (long)CURL_TIMECOND_NONE);
+  curl_easy_setopt(conn->easy, CURLOPT_TIMEVALUE, (long)conn->last_modified);
+  COUNT_ADD(g->cond_sent, conn->conditional);
+
+#ifdef DEBUG
+  fprintf(MSG_OUT,
+          "Adding easy %p to multi %p (%s)\n", conn->easy, g->multi, url);
+#endif
+
+  conn->start_us = now_us();
+  conn->connected_us = 0;  /* see prereq_cb */
+  conn->first_rx_us = conn->last_rx_us = 0;
+  conn->rx_bytes = conn->window_us = conn->window_rx = 0;
+  conn->reaped = -1;
+  conn->deadline_us = deadline_next(conn);
+  if (conn->deadline_us) {
+    deadline_add(g, conn);
+    if (conn->deadline_idx == 0)
+      deadline_arm(g, conn->start_us);
+  }
+
+  rc = curl_multi_add_handle(g->multi, conn->easy);
+  mcode_or_die("new_conn: curl_multi_add_handle", rc);
+  COUNT_ADD(g->in_flight, 1);
+  COUNT_ADD(g->started, 1);
+
+  /* note that the add_handle() will set a time-out to trigger very soon so
+     that the necessary socket_action() call will be called by this app */
+}
+
+static PendingUrl *pending_new(const char *url, size_t len, int lane)
+{
+  PendingUrl *p = (PendingUrl *)malloc(sizeof(PendingUrl) + len);
+
+  if (p == NULL) {
+    fprintf(MSG_OUT, "malloc failed!\n");
+    exit (1);
+  }
+  memcpy(p->url, url, len);
+  p->url[len] = '\0';
+  p->len = len;
+  p->queued_us = p->due_us = now_us();
+  p->lane = lane;
+  p->attempt = 0;
+  p->next = NULL;
+  return p;
+}
+
+/* --------------------------------
+   Scheduler
+
+   URLs wait in a queue per host. A host may start HOST_RATE transfers a
+   second (a token bucket of HOST_BURST) and have HOST_MAX_IN_FLIGHT
+   running. Hosts that may start one now sit on the ready list and take
+   turns; hosts out of tokens wait in a min-heap by the time their next
+   token is due, behind one loop timer; hosts at their concurrency cap
+   come back when a transfer finishes. Free transfer slots therefore go
+   to whichever hosts are within budget, in arrival order per host.
+
+   A host is ready in the lane of its most urgent URL. Lanes are drained
+   by weight, LANE_WEIGHTS starts each per round, or with LANE_STRICT in
+   order, except that a lane whose first host has waited LANE_MAX_WAIT_MS
+   goes next, so bulk is slowed but never starved. */
+
+enum { HQ_IDLE, HQ_READY, HQ_WAIT, HQ_CAPPED };
+
+static const char *url_host(const char *url, size_t len, size_t *hlen);
+static unsigned int host_hash(const char *host, size_t len);
+
+static void sched_refill(HostQueue *hq, long long now)
+{
+  if (HOST_RATE > 0) {
+    hq->tokens += (now - hq->refill_us) * (double)HOST_RATE / 1e6;
+    if (hq->tokens > HOST_BURST)
+      hq->tokens = HOST_BURST;
+  }
+  hq->refill_us = now;
+}
+
+static void sched_heap_swap(GlobalInfo *g, int a, int b)
+{
+  HostQueue *t = g->wait_heap[a];
+
+  g->wait_heap[a] = g->wait_heap[b];
+  g->wait_heap[b] = t;
+}
+
+static void sched_heap_push(GlobalInfo *g, HostQueue *hq)
+{
+  int i;
+
+  if (g->wait_len == g->wait_size) {
+    g->wait_size = g->wait_size ? g->wait_size * 2 : 64;
+    g->wait_heap = (HostQueue **)realloc(g->wait_heap,
+                                         g->wait_size * sizeof(HostQueue *));
+    if (g->wait_heap == NULL) {
+      fprintf(MSG_OUT, "realloc failed!\n");
+      exit (1);
+    }
+  }
+  i = g->wait_len;
+  COUNT_ADD(g->wait_len, 1);  /* read by the stats */
+  g->wait_heap[i] = hq;
+  for (; i > 0 && g->wait_heap[(i - 1) / 2]->next_us > hq->next_us;
+       i = (i - 1) / 2)
+    sched_heap_swap(g, i, (i - 1) / 2);
+}
+
+static HostQueue *sched_heap_pop(GlobalInfo *g)
+{
+  HostQueue *top = g->wait_heap[0];
+  int i = 0, c;
+
+  COUNT_ADD(g->wait_len, -1);
+  g->wait_heap[0] = g->wait_heap[g->wait_len];
+  while ((c = 2 * i + 1) < g->wait_len) {
+    if (c + 1 < g->wait_len &&
+        g->wait_heap[c + 1]->next_us < g->wait_heap[c]->next_us)
+      c++;
+    if (g->wait_heap[i]->next_us <= g->wait_heap[c]->next_us)
+      break;
+    sched_heap_swap(g, i, c);
+    i = c;
+  }
+  return top;
+}
+
+/* Point the timer at the first token due */
+static void sched_arm(GlobalInfo *g, long long now)
+{
+  long long ms;
+
+  if (!g->wait_len) {
+    watch_timer(g->sched_event, -1);
+    return;
+  }
+  ms = (g->wait_heap[0]->next_us - now + 999) / 1000;
+  watch_timer(g->sched_event, ms > 0 ? (long)ms : 0);
+}
+
+static const int lane_weight[LANES] = LANE_WEIGHTS;
+
+static int host_lane(const HostQueue *hq)
+{
+  int l;
+
+  for (l = 0; l < LANES - 1 && !hq->head[l]; l++)
+    ;
+  return l;
+}
+
+static void ready_unlink(GlobalInfo *g, HostQueue *hq)
+{
+  if (hq->ready_prev)
+    hq->ready_prev->ready_next = hq->ready_next;
+  else
+    g->ready_head[hq->lane] = hq->ready_next;
+  if (hq->ready_next)
+    hq->ready_next->ready_prev = hq->ready_prev;
+  else
+    g->ready_tail[hq->lane] = hq->ready_prev;
+  COUNT_ADD(g->hosts_ready, -1);
+  hq->state = HQ_IDLE;
+}
+
+/* File an idle host that has URLs queued */
+static void sched_place(GlobalInfo *g, HostQueue *hq, long long now)
+{
+  if (hq->in_flight >= HOST_MAX_IN_FLIGHT) {
+    hq->state = HQ_CAPPED;
+    COUNT_ADD(g->hosts_capped, 1);
+    return;
+  }
+  sched_refill(hq, now);
+  if (HOST_RATE <= 0 || hq->tokens >= 1) {
+    int l = host_lane(hq);
+
+    hq->state = HQ_READY;
+    hq->lane = l;
+    hq->ready_us = now;
+    hq->ready_next = NULL;
+    hq->ready_prev = g->ready_tail[l];
+    if (g->ready_tail[l])
+      g->ready_tail[l]->ready_next = hq;
+    else
+      g->ready_head[l] = hq;
+    g->ready_tail[l] = hq;
+    COUNT_ADD(g->hosts_ready, 1);
+    return;
+  }
+  hq->state = HQ_WAIT;
+  hq->next_us = now + (long long)((1 - hq->tokens) * 1e6 / HOST_RATE) + 1;
+  sched_heap_push(g, hq);
+  COUNT_ADD(g->sched_delayed, 1);
+  if (g->wait_heap[0] == hq)
+    sched_arm(g, now);
+}
+
+/* Drop hosts with nothing queued or running whose bucket is full again,
+   so forgetting them gives nothing away */
+static void sched_sweep(GlobalInfo *g, long long now)
+{
+  size_t i;
+
+  for (i = 0; i <= g->hq_mask; i++) {
+    HostQueue **pp = &g->hq_table[i], *hq;
+
+    while ((hq = *pp)) {
+      int idle = hq->state == HQ_IDLE && !hq->queued && !hq->in_flight;
+
+      if (idle)
+        sched_refill(hq, now);
+      if (idle && (HOST_RATE <= 0 || hq->tokens >= HOST_BURST)) {
+        *pp = hq->chain;
+        free(hq);
+        COUNT_ADD(g->hq_count, -1);
+      }
+      else
+        pp = &hq->chain;
+    }
+  }
+}
+
+static HostQueue *sched_host(GlobalInfo *g, const char *url, size_t len,
+                             long long now)
+{
+  size_t hlen, i;
+  const char *host = url_host(url, len, &hlen);
+  unsigned int h = host_hash(host, hlen);
+  HostQueue *hq;
+
+  for (hq = g->hq_table[h & g->hq_mask]; hq; hq = hq->chain)
+    if (hq->hash == h && hq->hlen == hlen && !strncasecmp(hq->host, host, hlen))
+      return hq;
+
+  if ((size_t)g->hq_count > g->hq_mask) {
+    sched_sweep(g, now);
+    if ((size_t)g->hq_count > g->hq_mask / 2) {  /* still busy, grow */
+      size_t n = (g->hq_mask + 1) * 2;
+      HostQueue **t = (HostQueue **)calloc(n, sizeof(HostQueue *));
+
+      if (t == NULL) {
+        fprintf(MSG_OUT, "calloc failed!\n");
+        exit (1);
+      }
+      for (i = 0; i <= g->hq_mask; i++)
+        while ((hq = g->hq_table[i])) {
+          g->hq_table[i] = hq->chain;
+          hq->chain = t[hq->hash & (n - 1)];
+          t[hq->hash & (n - 1)] = hq;
+        }
+      free(g->hq_table);
+      g->hq_table = t;
+      g->hq_mask = n - 1;
+    }
+  }
+
+  hq = (HostQueue *)calloc(1, sizeof(HostQueue) + hlen);
+  if (hq == NULL) {
+    fprintf(MSG_OUT, "calloc failed!\n");
+    exit (1);
+  }
+  hq->hash = h;
+  hq->hlen = hlen;
+  memcpy(hq->host, host, hlen);
+  hq->tokens = HOST_BURST;
+  hq->refill_us = now;
+  hq->chain = g->hq_table[h & g->hq_mask];
+  g->hq_table[h & g->hq_mask] = hq;
+  COUNT_ADD(g->hq_count, 1);
+  return hq;
+}
+
+/* Queue a list of URLs on their hosts */
+static void pending_splice(GlobalInfo *g, PendingUrl *head)
+{
+  long long now = now_us();
+  PendingUrl *p;
+
+  while ((p = head)) {
+    HostQueue *hq = sched_host(g, p->url, p->len, now);
+    int l = p->lane;
+
+    head = p->next;
+    p->next = NULL;
+    if (hq->tail[l])
+      hq->tail[l]->next = p;
+    else
+      hq->head[l] = p;
+    hq->tail[l] = p;
+    hq->queued++;
+    COUNT_ADD(g->pending, 1);
+    COUNT_ADD(g->pending_bytes, sizeof(PendingUrl) + p->len);
+    if (hq->state == HQ_READY && l < hq->lane)
+      ready_unlink(g, hq);  /* move up to the new URL's lane */
+    if (hq->state == HQ_IDLE)
+      sched_place(g, hq, now);
+  }
+}
+
+/* Queue a URL for fetching */
+static void queue_url(GlobalInfo *g, const char *url, size_t len, int lane)
+{
+  pending_splice(g, pending_new(url, len, lane));
+}
+
+/* A transfer of hq's finished */
+static void sched_done(GlobalInfo *g, HostQueue *hq)
+{
+  hq->in_flight--;
+  if (hq->state == HQ_CAPPED) {
+    COUNT_ADD(g->hosts_capped, -1);
+    hq->state = HQ_IDLE;
+    sched_place(g, hq, now_us());
+  }
+}
+
+/* The lane to start a transfer from, -1 if no host is ready */
+static int sched_lane(GlobalInfo *g, long long now)
+{
+  int l, tries;
+
+  if (!g->hosts_ready)
+    return -1;
+  if (LANE_STRICT) {
+    for (l = LANES - 1; l > 0; l--)  /* starving first */
+      if (g->ready_head[l] &&
+          now - g->ready_head[l]->ready_us > LANE_MAX_WAIT_MS * 1000LL)
+        return l;
+    for (l = 0; !g->ready_head[l]; l++)
+      ;
+    return l;
+  }
+  for (tries = 0; tries < 2 * LANES; tries++) {
+    l = g->lane_cur;
+    if (g->ready_head[l] && g->lane_credit[l] > 0) {
+      g->lane_credit[l]--;
+      return l;
+    }
+    g->lane_credit[l] = lane_weight[l];  /* for the next round */
+    g->lane_cur = (l + 1) % LANES;
+  }
+  return -1;  /* not reached, some lane has a host */
+}
+
+/* Start transfers for ready hosts until MAX_PARALLEL_WORKER are in flight */
+static void start_pending(GlobalInfo *g)
+{
+  long long now = now_us();
+  HostQueue *hq;
+  PendingUrl *p;
+  long long wait;
+  int l;
+
+  while (g->in_flight < g->max_in_flight && (l = sched_lane(g, now)) >= 0) {
+    hq = g->ready_head[l];
+    ready_unlink(g, hq);
+
+    p = hq->head[l];
+    hq->head[l] = p->next;
+    if (!hq->head[l])
+      hq->tail[l] = NULL;
+    hq->queued--;
+    hq->tokens -= 1;
+    hq->in_flight++;
+    COUNT_ADD(g->pending, -1);
+    COUNT_ADD(g->pending_bytes, -(sizeof(PendingUrl) + p->len));
+    wait = now - p->due_us;
+    COUNT_ADD(g->wait_us, wait);
+    COUNT_MAX(g->wait_max_us, wait);
+    hist_add(&g->lane_wait[l], wait);
+    new_conn(p, g, hq);
+    free(p);
+    if (hq->queued)
+      sched_place(g, hq, now);  /* to the back of the line */
+  }
+}
+
+/* A token is due for the first waiting host, maybe more */
+static void sched_cb(int fd, short kind, void *userp)
+{
+  GlobalInfo *g = (GlobalInfo *)userp;
+  long long now = now_us();
+  (void)fd;
+  (void)kind;
+
+  while (g->wait_len && g->wait_heap[0]->next_us <= now) {
+    HostQueue *hq = sched_heap_pop(g);
+    hq->state = HQ_IDLE;
+    sched_place(g, hq, now);
+  }
+  sched_arm(g, now);
+  start_pending(g);
+}
+
+static void sched_free(GlobalInfo *g)
+{
+  size_t i;
+  int l;
+  HostQueue *hq;
+  PendingUrl *p;
 
-  if (mysql_real_query(g_pConn, query, (unsigned int) (end - query)))
-  {
-	  fprintf(stderr, "Failed to insert row, Error: %s\n",
-		  mysql_error(g_pConn));
+  for (i = 0; i <= g->hq_mask; i++)
+    while ((hq = g->hq_table[i])) {
+      g->hq_table[i] = hq->chain;
+      for (l = 0; l < LANES; l++)
+        while ((p = hq->head[l])) {
+          hq->head[l] = p->next;
+          free(p);
+        }
+      free(hq);
+    }
+  free(g->hq_table);
+  free(g->wait_heap);
+}
+
+/* --------------------------------
+   Retries
+
+   A transfer that failed in a way worth trying again goes back to its
+   host's queue after a backoff: RETRY_BASE_MS for its class, doubled per
+   retry and jittered down by up to half, so URLs failed by one outage
+   don't all come back at once. A Retry-After is waited out in full.
+   Waiting URLs sit in a min-heap by due time behind one loop timer. A URL
+   out of retries is appended to DEAD_LETTER_FILE instead of being stored,
+   as is one that failed for good, on a TLS or write error say;
+   "cut -f1 hiper.dead" lists them for the fifo again. */
+
+static const char *const retry_name[RETRY_CLASSES] =
+  {"dns", "connect", "timeout", "reset", "5xx", "429"};
+static const int retry_attempts[RETRY_CLASSES] = RETRY_ATTEMPTS;
+static const int retry_base_ms[RETRY_CLASSES] = RETRY_BASE_MS;
+
+static int dead_fd = -1;  /* DEAD_LETTER_FILE, appended to by all shards */
+
+/* The class of a failed transfer, or -1 if it is final */
+static int retry_class(CURLcode res, long code)
+{
+  switch (res) {
+    case CURLE_OK:
+      if (code == 429)
+        return RETRY_429;
+      if (code >= 500 && code != 501 && code != 505)
+        return RETRY_5XX;
+      return -1;
+    case CURLE_COULDNT_RESOLVE_HOST:
+      return RETRY_DNS;
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_SSL_CONNECT_ERROR:
+      return RETRY_CONNECT;
+    case CURLE_OPERATION_TIMEDOUT:
+      return RETRY_TIMEOUT;
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+      return RETRY_RESET;
+    default:
+      return -1;
   }
-return realsize;
+}
 
-  //strncpy(szBuf, (const char*)ptr, size*nmemb);
-  //szBuf = substr(szBuf,0,realsize+1)
-  //sprintf(szBuf, "INSERT INTO writers VALUES('%s')", szBuf);
-  //printf("sql: %s\n", szBuf);
-  //mysql_query(g_pConn, szBuf);
-  return realsize;*/
+/* xorshift64* */
+static uint64_t retry_rand(GlobalInfo *g)
+{
+  g->rng ^= g->rng >> 12;
+  g->rng ^= g->rng << 25;
+  g->rng ^= g->rng >> 27;
+  return g->rng * 0x2545F4914F6CDD1DULL;
 }
 
+static void retry_heap_swap(GlobalInfo *g, int a, int b)
+{
+  PendingUrl *t = g->retry_heap[a];
 
-/* CURLOPT_PROGRESSFUNCTION */
-static int prog_cb (void *p, double dltotal, double dlnow, double ult,
-                    double uln)
+  g->retry_heap[a] = g->retry_heap[b];
+  g->retry_heap[b] = t;
+}
+
+static void retry_heap_push(GlobalInfo *g, PendingUrl *p)
 {
-  ConnInfo *conn = (ConnInfo *)p;
-  (void)ult;
-  (void)uln;
+  int i;
 
-  fprintf(MSG_OUT, "Progress: %s (%g/%g)\n", conn->url, dlnow, dltotal);
-  return 0;
+  if (g->retry_len == g->retry_size) {
+    g->retry_size = g->retry_size ? g->retry_size * 2 : 64;
+    g->retry_heap = (PendingUrl **)realloc(g->retry_heap,
+                                           g->retry_size * sizeof(PendingUrl *));
+    if (g->retry_heap == NULL) {
+      fprintf(MSG_OUT, "realloc failed!\n");
+      exit (1);
+    }
+  }
+  i = g->retry_len;
+  g->retry_heap[i] = p;
+  COUNT_ADD(g->retry_len, 1);  /* read by the stats and metrics */
+  for (; i > 0 && g->retry_heap[(i - 1) / 2]->due_us > p->due_us;
+       i = (i - 1) / 2)
+    retry_heap_swap(g, i, (i - 1) / 2);
 }
 
+static PendingUrl *retry_heap_pop(GlobalInfo *g)
+{
+  PendingUrl *top = g->retry_heap[0];
+  int i = 0, c;
+
+  COUNT_ADD(g->retry_len, -1);
+  g->retry_heap[0] = g->retry_heap[g->retry_len];
+  while ((c = 2 * i + 1) < g->retry_len) {
+    if (c + 1 < g->retry_len &&
+        g->retry_heap[c + 1]->due_us < g->retry_heap[c]->due_us)
+      c++;
+    if (g->retry_heap[i]->due_us <= g->retry_heap[c]->due_us)
+      break;
+    retry_heap_swap(g, i, c);
+    i = c;
+  }
+  return top;
+}
 
-/* Create a new easy handle, and add it to the global curl_multi */
-static void new_conn(char *url, GlobalInfo *g )
+/* Point the timer at the first retry due */
+static void retry_arm(GlobalInfo *g, long long now)
 {
-  ConnInfo *conn;
-  CURLMcode rc;
+  long long ms;
 
-  conn = (ConnInfo *)calloc(1, sizeof(ConnInfo));
-  if (conn == NULL) {
-	  fprintf(MSG_OUT, "calloc failed!\n");
-	  exit (1);
+  if (!g->retry_len) {
+    watch_timer(g->retry_event, -1);
+    return;
+  }
+  ms = (g->retry_heap[0]->due_us - now + 999) / 1000;
+  watch_timer(g->retry_event, ms > 0 ? (long)ms : 0);
+}
+
+/* One line per URL given up on. A single write to an O_APPEND file, so
+   lines from different shards don't interleave. */
+static void dead_letter(const char *url, const char *cls, int tries,
+                        const char *why)
+{
+  char tail[256];
+  struct iovec iov[2];
+  int n;
+
+  if (dead_fd == -1)
+    return;
+  n = snprintf(tail, sizeof(tail), "\t%s\t%d\t%.200s\n", cls, tries, why);
+  iov[0].iov_base = (void *)url;
+  iov[0].iov_len = strlen(url);
+  iov[1].iov_base = tail;
+  iov[1].iov_len = n < (int)sizeof(tail) ? n : sizeof(tail) - 1;
+  if (writev(dead_fd, iov, 2) < 0)
+    perror("writev(dead letters)");
+}
+
+/* The backoff in ms before try attempt + 1 of a URL that failed with cls:
+   the class's base doubled per try, capped at RETRY_MAX_MS, less up to
+   half of it at random, and no shorter than a Retry-After */
+static long long retry_delay(GlobalInfo *g, int cls, int attempt,
+                             long retry_after_ms)
+{
+  long long delay = (long long)retry_base_ms[cls] << (attempt < 20 ?
+                                                      attempt : 20);
+
+  if (delay > RETRY_MAX_MS)
+    delay = RETRY_MAX_MS;
+  delay -= (long long)(retry_rand(g) % (uint64_t)(delay / 2 + 1));
+  if (retry_after_ms > delay)
+    delay = retry_after_ms;
+  return delay;
+}
+
+/* Dead-letter a transfer, cls naming why it isn't tried again */
+static void retry_give_up(GlobalInfo *g, ConnInfo *conn, const char *cls,
+                          CURLcode res, long code)
+{
+  char why[CURL_ERROR_SIZE];
+
+  if (res == CURLE_OK)
+    snprintf(why, sizeof(why), "HTTP %ld", code);
+  else if (conn->truncated)
+    snprintf(why, sizeof(why), "page over %d bytes", MAX_WEBPAGE_SIZE);
+  else
+    snprintf(why, sizeof(why), "%s",
+             conn->error[0] ? conn->error : curl_easy_strerror(res));
+  dead_letter(conn->url, cls, conn->attempt + 1, why);
+  COUNT_ADD(g->dead, 1);
+  if (g->seen)
+    seen_forget(g->seen, conn->url, (unsigned int)(time(NULL) / 60));
+}
+
+/* Queue a failed transfer again, or give up on it. Returns 0 when the
+   response is final and to be stored as it is. */
+static int retry_check(GlobalInfo *g, ConnInfo *conn, CURLcode res,
+                       long code)
+{
+  int cls = retry_class(res, code);
+  long long delay, now;
+  PendingUrl *p;
+
+  if (cls < 0) {
+    if (res != CURLE_OK) {
+      /* no response worth a row, nor worth asking for again */
+      retry_give_up(g, conn, conn->truncated ? "too_large" : "final", res,
+                    code);
+      return 1;
+    }
+    if (conn->attempt && code < 400)
+      COUNT_ADD(g->retry_ok, 1);
+    return 0;
+  }
+  COUNT_ADD(g->failed[cls], 1);
+  delay = retry_delay(g, cls, conn->attempt, conn->retry_after_ms);
+
+  if (conn->attempt >= retry_attempts[cls] || delay > RETRY_MAX_MS) {
+    retry_give_up(g, conn, retry_name[cls], res, code);
+    return 1;
   }
 
-  memset(conn, 0, sizeof(ConnInfo));
-  conn->error[0]='\0';
+  now = now_us();
+  p = pending_new(conn->url, strlen(conn->url), conn->lane);
+  p->attempt = conn->attempt + 1;
+  p->queued_us = conn->queued_us;
+  p->due_us = now + delay * 1000;
+  retry_heap_push(g, p);
+  COUNT_ADD(g->retry_bytes, sizeof(PendingUrl) + p->len);
+  COUNT_ADD(g->retries[cls], 1);
+  if (g->retry_heap[0] == p)
+    retry_arm(g, now);
+  return 1;
+}
+
+/* Retries are due: back to their hosts' queues */
+static void retry_cb(int fd, short kind, void *userp)
+{
+  GlobalInfo *g = (GlobalInfo *)userp;
+  long long now = now_us();
+  PendingUrl *head = NULL, **tail = &head, *p;
+  (void)fd;
+  (void)kind;
 
-  if(0) {
-	  fprintf(MSG_OUT, "calloc %d %d %s!\n", (int)sizeof(ConnInfo),
-		  conn->cont_len, conn->content);	  
+  while (g->retry_len && g->retry_heap[0]->due_us <= now) {
+    p = retry_heap_pop(g);
+    COUNT_ADD(g->retry_bytes, -(sizeof(PendingUrl) + p->len));
+    p->due_us = now;
+    *tail = p;
+    tail = &p->next;
   }
+  pending_splice(g, head);
+  retry_arm(g, now);
+  start_pending(g);
+}
 
-  conn->easy = curl_easy_init();
-  if (!conn->easy) {
-    fprintf(MSG_OUT, "curl_easy_init() failed, exiting!\n");
-    exit(2);
+static void retry_free(GlobalInfo *g)
+{
+  while (g->retry_len)
+    free(g->retry_heap[--g->retry_len]);
+  free(g->retry_heap);
+}
+
+/* --------------------------------
+   Dispatcher
+
+   Shard 0 reads the fifo and sends every URL to the shard owning its
+   host, so connection reuse stays within one multi handle. */
+
+/* Find the host part of the len bytes at url (not NUL terminated) */
+static const char *url_host(const char *url, size_t len, size_t *hlen)
+{
+  const char *end = url + len;
+  const char *h = url;
+  const char *e;
+
+  for (e = url; e + 3 <= end; e++)
+    if (e[0] == ':' && e[1] == '/' && e[2] == '/') {
+      h = e + 3;
+      break;
+    }
+  for (e = h; e < end && *e != '/' && *e != ':' && *e != '?' && *e != '#'; e++)
+    if (*e == '@')
+      h = e + 1;  /* skip user info */
+  *hlen = e - h;
+  return h;
+}
+
+/* FNV-1a over the lower-cased host */
+static unsigned int host_hash(const char *host, size_t len)
+{
+  unsigned int h = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    unsigned char c = (unsigned char)host[i];
+    if (c >= 'A' && c <= 'Z')
+      c += 'a' - 'A';
+    h = (h ^ c) * 16777619u;
   }
-  conn->global = g;
-  conn->url = strdup(url);
-  curl_easy_setopt(conn->easy, CURLOPT_URL, conn->url);
-  curl_easy_setopt(conn->easy, CURLOPT_WRITEFUNCTION, write_cb);
-  curl_easy_setopt(conn->easy, CURLOPT_WRITEDATA, conn);
-  //curl_easy_setopt(conn->easy, CURLOPT_VERBOSE, 1L);
-  curl_easy_setopt(conn->easy, CURLOPT_ERRORBUFFER, conn->error);
-  curl_easy_setopt(conn->easy, CURLOPT_PRIVATE, conn);
-  //curl_easy_setopt(conn->easy, CURLOPT_NOPROGRESS, 0L);
-  //curl_easy_setopt(conn->easy, CURLOPT_PROGRESSFUNCTION, prog_cb);
-  //curl_easy_setopt(conn->easy, CURLOPT_PROGRESSDATA, conn);
-  //curl_easy_setopt(conn->easy,   CURLOPT_WRITEHEADER, headerfile);
-  //curl_easy_setopt(conn->easy, CURLOPT_HEADER, 1L); 
+  return h;
+}
+
+/* Count a finished transfer against its host in this shard's table; URLs
+   are routed by host, so no other shard sees the same host */
+static void host_bytes_add(GlobalInfo *g, const char *url, long long wire,
+                           long long decoded)
+{
+  size_t hlen;
+  const char *host = url_host(url, strlen(url), &hlen);
+  unsigned int h = host_hash(host, hlen) | 1;
+  unsigned int i;
+  HostBytes *hb;
+
+  COUNT_ADD(g->wire_bytes, wire);
+  COUNT_ADD(g->decoded_bytes, decoded);
+  if (hlen >= sizeof(hb->host))
+    hlen = sizeof(hb->host) - 1;
+  /* kept under 3/4 full, so the probe always ends on an empty slot */
+  for (i = h & (HOST_STATS_SLOTS - 1);; i = (i + 1) & (HOST_STATS_SLOTS - 1)) {
+    hb = &g->hosts[i];
+    if (!hb->hash)
+      break;
+    if (hb->hash == h && !strncasecmp(hb->host, host, hlen) &&
+        !hb->host[hlen])
+      goto found;
+  }
+  if ((g->nhosts + 1) * 4 > HOST_STATS_SLOTS * 3) {
+    COUNT_ADD(g->hosts_untracked, 1);
+    return;
+  }
+  memcpy(hb->host, host, hlen);
+  hb->host[hlen] = '\0';
+  __atomic_store_n(&hb->hash, h, __ATOMIC_RELEASE);  /* for stats_cb */
+  COUNT_ADD(g->nhosts, 1);
+found:
+  COUNT_ADD(hb->pages, 1);
+  COUNT_ADD(hb->wire, wire);
+  COUNT_ADD(hb->decoded, decoded);
+}
+
+/* Bytes queued on all shards, checked against PENDING_MAX_BYTES */
+static size_t pending_total(GlobalInfo *g)
+{
+  size_t total = 0;
+  int i;
+
+  for (i = 0; i < g->nshards; i++)
+    total += COUNT_GET(g->shards[i].pending_bytes) +
+             COUNT_GET(g->shards[i].inbox_bytes) +
+             g->shards[i].outbox_bytes + COUNT_GET(g->shards[i].retry_bytes);
+  return total;
+}
+
+/* Route one URL; other shards get theirs in dispatch_flush() */
+static void dispatch_url(GlobalInfo *g, const char *url, size_t len,
+                         int lane)
+{
+  GlobalInfo *to;
+  PendingUrl *p;
+  size_t hlen;
+  const char *host;
+
+  if (g->nshards == 1) {
+    queue_url(g, url, len, lane);
+    return;
+  }
+  host = url_host(url, len, &hlen);
+  to = &g->shards[host_hash(host, hlen) % g->nshards];
+  if (to == g) {
+    queue_url(g, url, len, lane);
+    return;
+  }
+  p = pending_new(url, len, lane);
+  if (to->outbox_tail)
+    to->outbox_tail->next = p;
+  else
+    to->outbox_head = p;
+  to->outbox_tail = p;
+  to->outbox++;
+  to->outbox_bytes += sizeof(PendingUrl) + len;
+}
+
+/* Hand each shard the URLs collected for it, one lock and wakeup apiece */
+static void dispatch_flush(GlobalInfo *g)
+{
+  int i;
+
+  for (i = 0; i < g->nshards; i++) {
+    GlobalInfo *to = &g->shards[i];
+    int wake;
+
+    if (!to->outbox_head)
+      continue;
+    pthread_mutex_lock(&to->inbox_lock);
+    wake = to->inbox_head == NULL;
+    if (to->inbox_tail)
+      to->inbox_tail->next = to->outbox_head;
+    else
+      to->inbox_head = to->outbox_head;
+    to->inbox_tail = to->outbox_tail;
+    COUNT_ADD(to->inbox, to->outbox);
+    COUNT_ADD(to->inbox_bytes, to->outbox_bytes);
+    pthread_mutex_unlock(&to->inbox_lock);
+    to->outbox_head = to->outbox_tail = NULL;
+    to->outbox = 0;
+    to->outbox_bytes = 0;
+
+    if (wake) {
+      uint64_t one = 1;
+      if (write(to->inbox_fd, &one, sizeof(one)) != sizeof(one))
+        perror("write(eventfd)");
+    }
+  }
+}
+
+/* Called on a shard's loop when the dispatcher filled its inbox */
+static void inbox_cb(int fd, short kind, void *userp)
+{
+  GlobalInfo *g = (GlobalInfo *)userp;
+  PendingUrl *head;
+  uint64_t n;
+  (void)kind;
+
+  if (read(fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+    perror("read(eventfd)");
+  if (__atomic_load_n(&g->stopping, __ATOMIC_ACQUIRE)) {
+    g->loop->ops->stop(g->loop);
+    return;
+  }
+
+  pthread_mutex_lock(&g->inbox_lock);
+  head = g->inbox_head;
+  g->inbox_head = g->inbox_tail = NULL;
+  __atomic_store_n(&g->inbox, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&g->inbox_bytes, 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&g->inbox_lock);
+
+  pending_splice(g, head);
+  start_pending(g);
+}
+
+/* --------------------------------
+   Fifo reader
+
+   URLs are separated by whitespace and may be of any length. The
+   splitter looks at 16 bytes per step where SSE2 is there. A token of
+   digits before a URL is its lane, "0 http://..." being the most urgent;
+   URLs without one go to LANE_DEFAULT. */
+
+static inline int is_space(char c)
+{
+  return c == ' ' || (unsigned char)(c - '\t') < 5;  /* \t \n \v \f \r */
+}
+
+/* Return the first whitespace byte in [p, end), or end */
+static const char *scan_space(const char *p, const char *end)
+{
+#ifdef __SSE2__
+  const __m128i sp = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8('\t');
+  const __m128i four = _mm_set1_epi8(4);
+
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i x = _mm_sub_epi8(v, tab);
+    /* x <= 4 unsigned, i.e. one of \t..\r, or a blank */
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(x, four), x),
+                             _mm_cmpeq_epi8(v, sp));
+    int mask = _mm_movemask_epi8(m);
+
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 16;
+  }
+#endif
+  while (p < end && !is_space(*p))
+    p++;
+  return p;
+}
+
+/* The lane a token of digits names, or -1 if [p, e) is not one */
+static int scan_lane(const char *p, const char *e)
+{
+  int lane = 0;
+
+  for (; p < e; p++) {
+    if (*p < '0' || *p > '9')
+      return -1;
+    if (lane < LANES)
+      lane = lane * 10 + (*p - '0');
+  }
+  return lane < LANES ? lane : LANES - 1;
+}
+
+/* Keep the unparsed tail and read() more behind it. Returns 0 when the
+   pipe has nothing for us right now. */
+static int reader_fill(LineReader *r)
+{
+  ssize_t n;
+
+  if (r->start) {
+    memmove(r->buf, r->buf + r->start, r->end - r->start);
+    r->end -= r->start;
+    r->start = 0;
+  }
+  if (r->end == r->size) {  /* one URL fills the buffer */
+    char *nb = (char *)realloc(r->buf, r->size * 2);
+    if (nb == NULL) {
+      fprintf(MSG_OUT, "realloc failed!\n");
+      exit (1);
+    }
+    r->buf = nb;
+    r->size *= 2;
+  }
+  do {
+    n = read(r->fd, r->buf + r->end, r->size - r->end);
+  } while (n == -1 && errno == EINTR);
+  if (n <= 0) {
+    if (n == -1 && errno != EAGAIN)
+      perror("read(fifo)");
+    return 0;
+  }
+  r->end += n;
+  return 1;
+}
+
+/* This gets called whenever data is received from the fifo */
+static void fifo_cb(int fd, short event, void *arg)
+{
+  GlobalInfo *g = (GlobalInfo *)arg;
+  LineReader *r = &g->input;
+  struct timespec t0, t1;
+  unsigned int minute = (unsigned int)(time(NULL) / 60);
+  (void)fd; /* unused */
+  (void)event; /* unused */
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  /* the rest stays in the pipe until the queues drain below budget */
+  while (pending_total(g) < PENDING_MAX_BYTES) {
+    const char *p = r->buf + r->start;
+    const char *end = r->buf + r->end;
+    const char *e;
+
+    while (p < end && is_space(*p))
+      p++;
+    e = scan_space(p, end);
+    if (e == end) {  /* nothing, or a URL cut by the read boundary */
+      r->start = p - r->buf;
+      if (!reader_fill(r))
+        break;
+      continue;
+    }
+    r->start = e + 1 - r->buf;
+    int lane = scan_lane(p, e);
+    if (lane >= 0) {  /* a priority for the next URL */
+      r->lane = lane;
+      continue;
+    }
+    lane = r->lane >= 0 ? r->lane : LANE_DEFAULT;
+    r->lane = -1;
+    /* an urgent URL is wanted again now, whenever it was last fetched */
+    if (lane < LANE_DEFAULT || !g->seen ||
+        !seen_check(g->seen, p, e - p, minute))
+      dispatch_url(g, p, e - p, lane);
+    r->urls++;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  r->busy_ns += (t1.tv_sec - t0.tv_sec) * 1000000000L +
+                (t1.tv_nsec - t0.tv_nsec);
+
+  dispatch_flush(g);
+  start_pending(g);  /* if we read a URL, go get it! */
+
+  if (pending_total(g) >= PENDING_MAX_BYTES) {
+    /* the fifo stays readable, stop watching it until the queues drain */
+    watch_io(g->fifo_event, 0);
+    g->fifo_pauses++;
+    __atomic_store_n(&g->fifo_paused, 1, __ATOMIC_RELEASE);
+    fifo_check_resume(g);  /* in case it drained meanwhile */
+  }
+}
+
+/* Called on any shard whose queue shrank: wake up the reader if it was
+   paused and the queues are below PENDING_LOW_BYTES again */
+static void fifo_check_resume(GlobalInfo *g)
+{
+  GlobalInfo *reader = &g->shards[0];
+  uint64_t one = 1;
+
+  if (__atomic_load_n(&reader->fifo_paused, __ATOMIC_ACQUIRE) != 1 ||
+      pending_total(g) >= PENDING_LOW_BYTES)
+    return;
+  if (__sync_bool_compare_and_swap(&reader->fifo_paused, 1, 2) &&
+      write(reader->resume_fd, &one, sizeof(one)) != sizeof(one))
+    perror("write(eventfd)");
+}
+
+static void resume_cb(int fd, short kind, void *userp)
+{
+  GlobalInfo *g = (GlobalInfo *)userp;
+  uint64_t n;
+  (void)kind;
+
+  if (read(fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+    perror("read(eventfd)");
+  __atomic_store_n(&g->fifo_paused, 0, __ATOMIC_RELEASE);
+  watch_io(g->fifo_event, WATCH_READ);
+  /* URLs left in the reader's buffer don't make the fifo readable */
+  fifo_cb(g->input.fd, WATCH_READ, g);
+}
+
+/* Print transfer window occupancy */
+static void stats_cb(int fd, short kind, void *userp)
+{
+  GlobalInfo *g = (GlobalInfo *)userp;
+  (void)fd;
+  (void)kind;
+
+  PersistStage *ps = g->persist;
+  long stored = 0, failed = 0, batches = 0, full = 0, lag = 0, lag_max = 0;
+  long streamed = 0;
+  long long put_us = 0;
+  int i;
+
+  long tc_conv = 0, tc_skip = 0, tc_fail = 0, tc_big = 0, tc_drop = 0;
+  long long tc_us = 0;
+  long dd_checked = 0, dd_hits = 0;
+  long long dd_saved = 0;
+
+  for (i = 0; i < ps->nwriters; i++) {
+    PageWriter *w = &ps->writers[i];
+    tc_conv += COUNT_GET(w->tc_converted);
+    tc_skip += COUNT_GET(w->tc_skipped);
+    tc_fail += COUNT_GET(w->tc_failed);
+    tc_big += COUNT_GET(w->tc_too_large);
+    tc_drop += COUNT_GET(w->tc_dropped);
+    tc_us += COUNT_GET(w->tc_us);
+    dd_checked += COUNT_GET(w->dedup_checked);
+    dd_hits += COUNT_GET(w->dedup_hits);
+    dd_saved += COUNT_GET(w->dedup_saved);
+    stored += COUNT_GET(w->sink.stored);
+    failed += COUNT_GET(w->sink.failed);
+    batches += COUNT_GET(w->sink.batches);
+    streamed += COUNT_GET(w->sink.streamed);
+    put_us += COUNT_GET(w->sink.put_us);
+    full += COUNT_GET(w->sink.full_batches);
+    if (COUNT_GET(w->lag_ms) > lag)
+      lag = COUNT_GET(w->lag_ms);
+    long m = COUNT_TAKE(w->lag_max_ms);
+    if (m > lag_max)
+      lag_max = m;
+  }
+
+  int in_flight = 0;
+  long pending = 0, started = 0, completed = 0, min_done = -1, max_done = 0;
+  long starts = 0, callbacks = 0, cond_sent = 0, not_modified = 0;
+  long pages = 0, connects = 0, h2_pages = 0, done_total = 0;
+  long tls_full = 0, tls_resumed = 0;
+  long long nm_bytes = 0;
+  long sock_new = 0, sock_allocs = 0, sock_changes = 0, sock_same = 0;
+  long long wait_us = 0, wait_max_us = 0;
+  size_t pending_bytes = 0;
+
+  for (i = 0; i < g->nshards; i++) {
+    GlobalInfo *sh = &g->shards[i];
+    long sh_completed = COUNT_GET(sh->completed);
+    long sh_started = COUNT_GET(sh->started);
+    long sh_connects = COUNT_GET(sh->connects);
+    long sh_queued = COUNT_GET(sh->pending) + COUNT_GET(sh->inbox);
+    long sh_changes = COUNT_GET(sh->sock_changes);
+    long sh_same = COUNT_GET(sh->sock_same);
+    long sh_dispatched = COUNT_GET(sh->loop->dispatched);
+    long long sh_wait_us = COUNT_GET(sh->wait_us);
+    long long sh_wait_max = COUNT_TAKE(sh->wait_max_us);
+    long done = sh_completed - sh->last_completed;
+
+    pages += done;
+    connects += sh_connects - sh->last_connects;
+    sh->last_connects = sh_connects;
+    h2_pages += COUNT_GET(sh->h2_pages);
+    tls_full += COUNT_GET(sh->tls_full);
+    tls_resumed += COUNT_GET(sh->tls_resumed);
+    done_total += sh_completed;
+
+    in_flight += COUNT_GET(sh->in_flight);
+    pending += sh_queued;
+    pending_bytes += COUNT_GET(sh->pending_bytes) +
+                     COUNT_GET(sh->inbox_bytes);
+    started += sh_started;
+    completed += sh_completed;
+    if (min_done < 0 || done < min_done)
+      min_done = done;
+    if (done > max_done)
+      max_done = done;
+    if (g->nshards > 1)
+      fprintf(MSG_OUT, "\nshard %d: in flight %d/%d, queued %ld, "
+              "completed %ld, %ld pages/s", i, COUNT_GET(sh->in_flight),
+              sh->max_in_flight, sh_queued, sh_completed,
+              done / STATS_SECONDS);
+    sh->last_completed = sh_completed;
+    starts += sh_started - sh->last_started;
+    wait_us += sh_wait_us - sh->last_wait_us;
+    if (sh_wait_max > wait_max_us)
+      wait_max_us = sh_wait_max;
+    callbacks += sh_dispatched - sh->last_dispatched;
+    sock_new += COUNT_GET(sh->sock_new);
+    sock_allocs += COUNT_GET(sh->sock_allocs);
+    sock_changes += sh_changes - sh->last_sock_changes;
+    sock_same += sh_same - sh->last_sock_same;
+    cond_sent += COUNT_GET(sh->cond_sent);
+    not_modified += COUNT_GET(sh->not_modified);
+    nm_bytes += COUNT_GET(sh->nm_bytes);
+    sh->last_sock_changes = sh_changes;
+    sh->last_sock_same = sh_same;
+    sh->last_dispatched = sh_dispatched;
+    sh->last_started = sh_started;
+    sh->last_wait_us = sh_wait_us;
+  }
+
+  g->pages_per_sec = (double)pages / STATS_SECONDS;
+  fprintf(MSG_OUT, "\nstats: in flight %d/%d, queued %ld (%lu KB), "
+          "started %ld, completed %ld\n",
+          in_flight, MAX_PARALLEL_WORKER, pending,
+          (unsigned long)(pending_bytes / 1024), started, completed);
+  if (g->nshards > 1)
+    fprintf(MSG_OUT, "shards: %d, pages/s min %ld max %ld\n", g->nshards,
+            min_done / STATS_SECONDS, max_done / STATS_SECONDS);
+  LineReader *r = &g->input;
+  long busy_ns = r->busy_ns - r->last_busy_ns;
+  fprintf(MSG_OUT, "ingest: %ld urls, %ld urls/s, %.0f urls/s while busy, "
+          "buffer %lu KB\n", r->urls, (r->urls - r->last_urls) / STATS_SECONDS,
+          busy_ns ? (r->urls - r->last_urls) * 1e9 / busy_ns : 0.0,
+          (unsigned long)(r->size / 1024));
+  fprintf(MSG_OUT, "start latency: avg %.2f ms, max %.2f ms, "
+          "reader %s, paused %ld times\n",
+          starts ? wait_us / 1000.0 / starts : 0.0, wait_max_us / 1000.0,
+          g->fifo_paused ? "paused" : "reading", g->fifo_pauses);
+  int l;
+  for (l = 0; l < LANES; l++) {
+    Histogram lw, ld;
+    long nw = 0, nd = 0;
+
+    memset(&lw, 0, sizeof(lw));
+    memset(&ld, 0, sizeof(ld));
+    for (i = 0; i < g->nshards; i++) {
+      GlobalInfo *sh = &g->shards[i];
+
+      nw += hist_take(&lw, &sh->lane_wait[l], &sh->last_lane_wait[l]);
+      nd += hist_take(&ld, &sh->lane_done[l], &sh->last_lane_done[l]);
+    }
+    fprintf(MSG_OUT, "lane %d: started %ld, start wait p50 %.1f ms p99 %.1f "
+            "ms, done p99 %.1f ms\n", l, nw,
+            nw ? hist_pct(&lw, nw, 0.5) / 1000.0 : 0.0,
+            nw ? hist_pct(&lw, nw, 0.99) / 1000.0 : 0.0,
+            nd ? hist_pct(&ld, nd, 0.99) / 1000.0 : 0.0);
+  }
+  r->last_urls = r->urls;
+  r->last_busy_ns = r->busy_ns;
+  fprintf(MSG_OUT, "validators: %lu known, %ld conditional requests, "
+          "%ld not modified (%.1f%%), %lld KB and %ld rows not written\n",
+          (unsigned long)validators_count(g->validators), cond_sent,
+          not_modified, cond_sent ? 100.0 * not_modified / cond_sent : 0.0,
+          nm_bytes / 1024, not_modified);
+
+  long retries[RETRY_CLASSES] = {0}, retry_ok = 0, dead = 0, retry_wait = 0;
+  for (i = 0; i < g->nshards; i++) {
+    GlobalInfo *sh = &g->shards[i];
+
+    for (l = 0; l < RETRY_CLASSES; l++)
+      retries[l] += COUNT_GET(sh->retries[l]);
+    retry_ok += COUNT_GET(sh->retry_ok);
+    dead += COUNT_GET(sh->dead);
+    retry_wait += COUNT_GET(sh->retry_len);
+  }
+  fprintf(MSG_OUT, "retries: dns %ld, connect %ld, timeout %ld, reset %ld, "
+          "5xx %ld, 429 %ld; %ld waiting, %ld succeeded, %ld given up\n",
+          retries[RETRY_DNS], retries[RETRY_CONNECT], retries[RETRY_TIMEOUT],
+          retries[RETRY_RESET], retries[RETRY_5XX], retries[RETRY_429],
+          retry_wait, retry_ok, dead);
+
+  long reaped[REAP_REASONS] = {0}, stalls = 0;
+  Histogram stall;
+  memset(&stall, 0, sizeof(stall));
+  for (i = 0; i < g->nshards; i++) {
+    GlobalInfo *sh = &g->shards[i];
+
+    for (l = 0; l < REAP_REASONS; l++)
+      reaped[l] += COUNT_GET(sh->reaped[l]);
+    stalls += hist_take(&stall, &sh->reap_stall, &sh->last_reap_stall);
+  }
+  fprintf(MSG_OUT, "reaped: connect %ld, first byte %ld, low speed %ld, "
+          "total %ld; %ld now, silent p50 %.1f s p99 %.1f s before\n",
+          reaped[REAP_CONNECT], reaped[REAP_FIRST_BYTE],
+          reaped[REAP_LOW_SPEED], reaped[REAP_TOTAL], stalls,
+          stalls ? hist_pct(&stall, stalls, 0.5) / 1e6 : 0.0,
+          stalls ? hist_pct(&stall, stalls, 0.99) / 1e6 : 0.0);
+
+  /* the hosts costing the most on the wire */
+  HostBytes *top[3] = {NULL, NULL, NULL};
+  HostBytes *busiest = NULL;
+  long long wire = 0, decoded = 0;
+  long untracked = 0, busiest_pages = 0, delayed = 0;
+  int nhosts = 0, queued_hosts = 0, ready = 0, waiting = 0, capped = 0;
+  int j, k;
+
+  for (i = 0; i < g->nshards; i++) {
+    GlobalInfo *sh = &g->shards[i];
+
+    long sh_delayed = COUNT_GET(sh->sched_delayed);
+
+    wire += COUNT_GET(sh->wire_bytes);
+    decoded += COUNT_GET(sh->decoded_bytes);
+    untracked += COUNT_GET(sh->hosts_untracked);
+    nhosts += COUNT_GET(sh->nhosts);
+    queued_hosts += COUNT_GET(sh->hq_count);
+    ready += COUNT_GET(sh->hosts_ready);
+    waiting += COUNT_GET(sh->wait_len);
+    capped += COUNT_GET(sh->hosts_capped);
+    delayed += sh_delayed - sh->last_sched_delayed;
+    sh->last_sched_delayed = sh_delayed;
+    for (j = 0; j < HOST_STATS_SLOTS; j++) {
+      HostBytes *hb = &sh->hosts[j];
+      if (!__atomic_load_n(&hb->hash, __ATOMIC_ACQUIRE))
+        continue;
+      long pages = COUNT_GET(hb->pages);
+      if (pages - sh->host_last_pages[j] > busiest_pages) {
+        busiest_pages = pages - sh->host_last_pages[j];
+        busiest = hb;
+      }
+      sh->host_last_pages[j] = pages;
+      for (k = 2; k >= 0 && (!top[k] || COUNT_GET(top[k]->wire) <
+                                        COUNT_GET(hb->wire)); k--)
+        if (k < 2)
+          top[k + 1] = top[k];
+      if (k < 2)
+        top[k + 1] = hb;
+    }
+  }
+  fprintf(MSG_OUT, "http: %ld connections/s opened, %.3f handshakes per page, "
+          "%.0f%% of pages over HTTP/2, %d per host cap\n",
+          connects / STATS_SECONDS, pages ? (double)connects / pages : 0.0,
+          done_total ? 100.0 * h2_pages / done_total : 0.0,
+          MAX_HOST_CONNECTIONS);
+#ifdef HAVE_OPENSSL
+  fprintf(MSG_OUT, "tls: %ld handshakes, %ld resumed (%.1f%%), %ld full\n",
+          tls_full + tls_resumed, tls_resumed, tls_full + tls_resumed ?
+          100.0 * tls_resumed / (tls_full + tls_resumed) : 0.0, tls_full);
+#else
+  fprintf(MSG_OUT, "tls: %ld handshakes (resumed ones are told apart "
+          "with HAVE_OPENSSL)\n", tls_full + tls_resumed);
+#endif
+  fprintf(MSG_OUT, "encoding: %lld KB on the wire, %lld KB decoded (%.1fx)%s\n",
+          wire / 1024, decoded / 1024, wire ? (double)decoded / wire : 0.0,
+          STORE_ENCODED ? ", gzip stored undecoded" : "");
+  fprintf(MSG_OUT, "hosts: %d tracked, %ld transfers untracked; top by wire:",
+          nhosts, untracked);
+  for (k = 0; k < 3 && top[k]; k++)
+    fprintf(MSG_OUT, " %s %lld/%lld KB", top[k]->host,
+            COUNT_GET(top[k]->wire) / 1024, COUNT_GET(top[k]->decoded) / 1024);
+  fprintf(MSG_OUT, "\n");
+  fprintf(MSG_OUT, "sched: %d hosts, %d ready, %d waiting for a token, "
+          "%d at %d in flight, %ld token waits/s; busiest %s %.1f pages/s "
+          "(limit %d)\n", queued_hosts, ready, waiting, capped,
+          HOST_MAX_IN_FLIGHT, delayed / STATS_SECONDS,
+          busiest ? busiest->host : "-",
+          (double)busiest_pages / STATS_SECONDS, HOST_RATE);
+  if (g->seen) {
+    long checked = COUNT_GET(g->seen->checked);
+    long skipped = COUNT_GET(g->seen->skipped);
+
+    fprintf(MSG_OUT, "seen: %ld urls checked, %ld fetches avoided (%.1f%%), "
+            "%ld entries lost to overflow\n", checked, skipped,
+            checked ? 100.0 * skipped / checked : 0.0,
+            COUNT_GET(g->seen->overflows));
+  }
+  fprintf(MSG_OUT, "sink: %ld rows/s, stored %ld, failed %ld, %ld batches "
+          "(%ld full), avg fill %.1f%%, %ld streamed, %.1f us/row\n",
+          (stored - ps->last_stored) / STATS_SECONDS,
+          stored, failed, batches, full,
+          batches ? 100.0 * (stored + failed - streamed) / batches / BATCH_ROWS
+                  : 0.0, streamed,
+          stored + failed ? (double)put_us / (stored + failed) : 0.0);
+  fprintf(MSG_OUT, "persist: %d writers, queue depth %lu/%d, "
+          "lag %ld ms (max %ld ms), stalls %ld\n",
+          ps->nwriters, (unsigned long)persist_depth(ps), PERSIST_QUEUE_SIZE,
+          lag, lag_max, COUNT_GET(ps->stalls));
+  ps->last_stored = stored;
+  long tc_pages = tc_conv + tc_skip + tc_fail;
+  fprintf(MSG_OUT, "transcode: %ld pages/s, %.0f pages/s while busy; "
+          "converted %ld, ascii/utf-8 %ld, failed %ld, too large %ld, "
+          "%ld bad bytes dropped\n",
+          (tc_pages - ps->last_transcoded) / STATS_SECONDS,
+          tc_us > ps->last_tc_us ?
+          (tc_pages - ps->last_transcoded) * 1e6 / (tc_us - ps->last_tc_us) : 0.0,
+          tc_conv, tc_skip, tc_fail, tc_big, tc_drop);
+  ps->last_transcoded = tc_pages;
+  ps->last_tc_us = tc_us;
+  fprintf(MSG_OUT, "dedup: checked %ld, duplicates %ld (%.1f%%), "
+          "%lld KB not stored, %lu digests known\n", dd_checked, dd_hits,
+          dd_checked ? 100.0 * dd_hits / dd_checked : 0.0, dd_saved / 1024,
+          (unsigned long)digest_count(ps->digests));
+  fprintf(MSG_OUT, "loop: %s/%s, %ld callbacks/s\n", g->loop->ops->name,
+          g->loop->method, callbacks / STATS_SECONDS);
+  /* event_free + event_new cost a DEL and an ADD per change, or per
+     unchanged call; in place it is one MOD or nothing */
+  fprintf(MSG_OUT, "sockets: %ld interest changes/s, %ld unchanged/s, "
+          "~%ld epoll_ctl/s saved, %ld of %ld SockInfo from the pool\n",
+          sock_changes / STATS_SECONDS, sock_same / STATS_SECONDS,
+          ((g->loop->coalesces ? sock_changes : 0) + 2 * sock_same) /
+          STATS_SECONDS, sock_new - sock_allocs, sock_new);
+
+  watch_timer(g->stats_event, STATS_SECONDS * 1000);
+}
+
+/* --------------------------------
+   Metrics
+
+   Shard 0 serves the counters as Prometheus text on METRICS_LISTEN to
+   any HTTP request, one response per connection. The numbers are summed
+   from the per-thread counters at request time, so a scrape costs the
+   loop a few microseconds and nothing else is done per URL; rates are
+   left to the scraper, except pages/s over the last stats tick. A client
+   gets METRICS_TIMEOUT_MS to send its request, so idle or trickling
+   connections don't pile up on the loop. */
+
+typedef struct _MetricsClient
+{
+  GlobalInfo *global;
+  int fd;
+  Watch *ev;
+  Watch *timer;        /* METRICS_TIMEOUT_MS after the accept */
+  char buf[2048];      /* the request, only read to its end */
+  size_t len;
+} MetricsClient;
+
+static void metric_head(FILE *f, const char *name, const char *type,
+                        const char *help)
+{
+  fprintf(f, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void metrics_render(FILE *f, GlobalInfo *g)
+{
+  static const char *const reap_name[REAP_REASONS] =
+    {"connect", "first_byte", "low_speed", "total"};
+  PersistStage *ps = g->persist;
+  long queued = 0, started = 0, completed = 0, dead = 0, waiting = 0;
+  long failed[RETRY_CLASSES] = {0}, retries[RETRY_CLASSES] = {0};
+  long reaped[REAP_REASONS] = {0}, stored = 0, rows_failed = 0;
+  long long wire = 0, decoded = 0;
+  int in_flight = 0, i, k;
+
+  for (i = 0; i < g->nshards; i++) {
+    GlobalInfo *sh = &g->shards[i];
+
+    queued += COUNT_GET(sh->pending) + COUNT_GET(sh->inbox) + sh->outbox;
+    waiting += COUNT_GET(sh->retry_len);
+    in_flight += COUNT_GET(sh->in_flight);
+    started += COUNT_GET(sh->started);
+    completed += COUNT_GET(sh->completed);
+    dead += COUNT_GET(sh->dead);
+    wire += COUNT_GET(sh->wire_bytes);
+    decoded += COUNT_GET(sh->decoded_bytes);
+    for (k = 0; k < RETRY_CLASSES; k++) {
+      failed[k] += COUNT_GET(sh->failed[k]);
+      retries[k] += COUNT_GET(sh->retries[k]);
+    }
+    for (k = 0; k < REAP_REASONS; k++)
+      reaped[k] += COUNT_GET(sh->reaped[k]);
+  }
+  for (i = 0; i < ps->nwriters; i++)
+    dead += COUNT_GET(ps->writers[i].tc_too_large);  /* too big as UTF-8 */
+
+  metric_head(f, "hiper_urls_read_total", "counter",
+              "URLs read from the fifo.");
+  fprintf(f, "hiper_urls_read_total %ld\n", g->input.urls);
+  metric_head(f, "hiper_queued_urls", "gauge",
+              "URLs read and waiting for a transfer slot.");
+  fprintf(f, "hiper_queued_urls %ld\n", queued);
+  metric_head(f, "hiper_queued_bytes", "gauge",
+              "Memory held by queued URLs and retries.");
+  fprintf(f, "hiper_queued_bytes %lld\n",
+          (long long)pending_total(g));
+  metric_head(f, "hiper_retry_waiting_urls", "gauge",
+              "Failed URLs waiting out a backoff.");
+  fprintf(f, "hiper_retry_waiting_urls %ld\n", waiting);
+  metric_head(f, "hiper_in_flight", "gauge", "Transfers running.");
+  fprintf(f, "hiper_in_flight %d\n", in_flight);
+  metric_head(f, "hiper_in_flight_max", "gauge", "MAX_PARALLEL_WORKER.");
+  fprintf(f, "hiper_in_flight_max %d\n", MAX_PARALLEL_WORKER);
+  metric_head(f, "hiper_transfers_started_total", "counter",
+              "Transfers handed to curl, retries included.");
+  fprintf(f, "hiper_transfers_started_total %ld\n", started);
+  metric_head(f, "hiper_transfers_completed_total", "counter",
+              "Transfers finished, whatever the result.");
+  fprintf(f, "hiper_transfers_completed_total %ld\n", completed);
+  metric_head(f, "hiper_transfers_failed_total", "counter",
+              "Transfers that failed in a way worth retrying.");
+  for (k = 0; k < RETRY_CLASSES; k++)
+    fprintf(f, "hiper_transfers_failed_total{class=\"%s\"} %ld\n",
+            retry_name[k], failed[k]);
+  metric_head(f, "hiper_retries_total", "counter", "Retries scheduled.");
+  for (k = 0; k < RETRY_CLASSES; k++)
+    fprintf(f, "hiper_retries_total{class=\"%s\"} %ld\n", retry_name[k],
+            retries[k]);
+  metric_head(f, "hiper_dead_letters_total", "counter",
+              "URLs given up on, in " DEAD_LETTER_FILE ".");
+  fprintf(f, "hiper_dead_letters_total %ld\n", dead);
+  metric_head(f, "hiper_reaped_total", "counter",
+              "Transfers aborted for a missed deadline.");
+  for (k = 0; k < REAP_REASONS; k++)
+    fprintf(f, "hiper_reaped_total{deadline=\"%s\"} %ld\n", reap_name[k],
+            reaped[k]);
+  metric_head(f, "hiper_received_bytes_total", "counter",
+              "Response bodies, as sent and after decoding.");
+  fprintf(f, "hiper_received_bytes_total{encoding=\"wire\"} %lld\n"
+          "hiper_received_bytes_total{encoding=\"decoded\"} %lld\n",
+          wire, decoded);
+  metric_head(f, "hiper_pages_per_second", "gauge",
+              "Transfers completed per second over the last stats tick.");
+  fprintf(f, "hiper_pages_per_second %.1f\n", g->pages_per_sec);
+
+  metric_head(f, "hiper_sink_queue_pages", "gauge",
+              "Finished pages waiting for a writer.");
+  fprintf(f, "hiper_sink_queue_pages %lu\n",
+          (unsigned long)persist_depth(ps));
+  metric_head(f, "hiper_sink_lag_seconds", "gauge",
+              "Queue wait of the last page each writer took.");
+  for (i = 0; i < ps->nwriters; i++) {
+    PageWriter *w = &ps->writers[i];
+
+    stored += COUNT_GET(w->sink.stored);
+    rows_failed += COUNT_GET(w->sink.failed);
+    fprintf(f, "hiper_sink_lag_seconds{writer=\"%d\"} %.3f\n", i,
+            COUNT_GET(w->lag_ms) / 1000.0);
+  }
+  metric_head(f, "hiper_rows_stored_total", "counter", "Rows written.");
+  fprintf(f, "hiper_rows_stored_total %ld\n", stored);
+  metric_head(f, "hiper_rows_failed_total", "counter",
+              "Rows lost to database errors.");
+  fprintf(f, "hiper_rows_failed_total %ld\n", rows_failed);
+}
 
-#ifdef DEBUG
-  fprintf(MSG_OUT,
-          "Adding easy %p to multi %p (%s)\n", conn->easy, g->multi, url);
-#endif
+static void metrics_client_free(MetricsClient *mc)
+{
+  watch_free(mc->ev);
+  watch_free(mc->timer);
+  close(mc->fd);
+  free(mc);
+}
 
-  rc = curl_multi_add_handle(g->multi, conn->easy);
-  mcode_or_die("new_conn: curl_multi_add_handle", rc);
+/* No full request in time: hang up */
+static void metrics_timeout_cb(int fd, short kind, void *arg)
+{
+  (void)fd;
+  (void)kind;
+  metrics_client_free((MetricsClient *)arg);
+}
 
-  /* note that the add_handle() will set a time-out to trigger very soon so
-     that the necessary socket_action() call will be called by this app */
+/* Read the request to its blank line, then answer and hang up */
+static void metrics_client_cb(int fd, short kind, void *arg)
+{
+  MetricsClient *mc = (MetricsClient *)arg;
+  char head[160], *body = NULL;
+  size_t body_len = 0;
+  struct iovec iov[2];
+  ssize_t n;
+  FILE *f;
+  (void)kind;
+
+  n = read(fd, mc->buf + mc->len, sizeof(mc->buf) - 1 - mc->len);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (n <= 0) {
+    metrics_client_free(mc);
+    return;
+  }
+  mc->len += n;
+  mc->buf[mc->len] = '\0';
+  if (!strstr(mc->buf, "\r\n\r\n") && !strstr(mc->buf, "\n\n") &&
+      mc->len < sizeof(mc->buf) - 1)
+    return;
+
+  f = open_memstream(&body, &body_len);
+  if (f == NULL) {
+    perror("open_memstream");
+    metrics_client_free(mc);
+    return;
+  }
+  metrics_render(f, mc->global);
+  fclose(f);
+  iov[0].iov_base = head;
+  iov[0].iov_len = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %lu\r\nConnection: close\r\n\r\n",
+                            (unsigned long)body_len);
+  iov[1].iov_base = body;
+  iov[1].iov_len = body_len;
+  /* a few KB into an empty local socket buffer: one write does it */
+  if (writev(fd, iov, 2) < 0)
+    perror("writev(metrics)");
+  free(body);
+  metrics_client_free(mc);
 }
 
-/* This gets called whenever data is received from the fifo */
-static void fifo_cb(int fd, short event, void *arg)
+static void metrics_accept_cb(int fd, short kind, void *arg)
 {
-  char s[1024];
-  long int rv=0;
-  int n=0;
   GlobalInfo *g = (GlobalInfo *)arg;
-  (void)fd; /* unused */
-  (void)event; /* unused */
+  MetricsClient *mc;
+  int c;
+  (void)kind;
 
-#ifdef MYSQL_DB
-  mysql_query(g_pConn, "INSERT INTO writers (name,size) VALUES('start running', 1)");
-#else
-  PGresult   *res;
-  res = PQexec(g_pConn, "INSERT INTO writers (name,size) VALUES('start running', 1)");
-  //if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-  if (PQresultStatus(res) != PGRES_COMMAND_OK) {	
-		  puts("command error: running!");
+  while ((c = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    mc = (MetricsClient *)calloc(1, sizeof(MetricsClient));
+    if (mc == NULL) {
+      fprintf(MSG_OUT, "calloc failed!\n");
+      exit (1);
+    }
+    mc->global = g;
+    mc->fd = c;
+    mc->ev = watch_new(g->loop, c, metrics_client_cb, mc);
+    watch_io(mc->ev, WATCH_READ);
+    mc->timer = watch_new(g->loop, -1, metrics_timeout_cb, mc);
+    watch_timer(mc->timer, METRICS_TIMEOUT_MS);
   }
-#endif	  
+}
 
-  int counter = 0;
-  do {
-		//mysql_query(g_pConn, "INSERT INTO writers (name,size) VALUES('do', 1)");
-		
-    s[0]='\0';
-    rv=fscanf(g->input, "%1023s%n", s, &n);
-    s[n]='\0';
-		
-    if ( n && s[0] ) {		
-			/*
-			if (g_share_counter >= MAX_PARALLEL_WORKER) {
-				sleep(2);
-				//__sync_fetch_and_sub(&g_share_counter, 1);
-				g_share_counter = 0;
-				fprintf(MSG_OUT, "sleep.");
-			}*/
-			fprintf(MSG_OUT, ".");
-      new_conn(s,g);  /* if we read a URL, go get it! */
-
-			if (++counter > 120) {puts("return."); return;}
-
-#ifdef DEBUG			
-			fprintf(MSG_OUT, "new_conn() counter:%ld", g_share_counter);
-			__sync_fetch_and_add(&g_share_counter, 1);
-#endif			
-			
-			//mysql_query(g_pConn, "INSERT INTO writers (name,size) VALUES('new conn', 1)");
-    } else break;
-  } while ( rv != EOF);
+/* Listen on METRICS_LISTEN: "ip:port", or a unix socket path */
+static void metrics_start(GlobalInfo *g, const char *addr)
+{
+  const char *colon = strrchr(addr, ':');
+  int fd, one = 1;
+
+  g->metrics_fd = -1;
+  if (!*addr)
+    return;
+  if (strchr(addr, '/') || !colon) {
+    struct sockaddr_un su;
+
+    memset(&su, 0, sizeof(su));
+    su.sun_family = AF_UNIX;
+    snprintf(su.sun_path, sizeof(su.sun_path), "%s", addr);
+    unlink(addr);  /* left over from a previous run */
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1 || bind(fd, (struct sockaddr *)&su, sizeof(su)) == -1)
+      goto fail;
+  }
+  else {
+    struct sockaddr_in sin;
+    char host[64];
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons((unsigned short)atoi(colon + 1));
+    snprintf(host, sizeof(host), "%.*s", (int)(colon - addr), addr);
+    if (inet_pton(AF_INET, host, &sin.sin_addr) != 1) {
+      fprintf(MSG_OUT, "metrics: bad address %s\n", addr);
+      return;
+    }
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd != -1)
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (fd == -1 || bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == -1)
+      goto fail;
+  }
+  if (listen(fd, 16) == -1)
+    goto fail;
+  g->metrics_fd = fd;
+  g->metrics_event = watch_new(g->loop, fd, metrics_accept_cb, g);
+  watch_io(g->metrics_event, WATCH_READ);
+  fprintf(MSG_OUT, "metrics on %s\n", addr);
+  return;
+
+fail:
+  perror("metrics");
+  if (fd != -1)
+    close(fd);
+}
+
+static void metrics_stop(GlobalInfo *g, const char *addr)
+{
+  if (g->metrics_fd == -1)
+    return;
+  watch_free(g->metrics_event);
+  close(g->metrics_fd);
+  if (strchr(addr, '/') || !strrchr(addr, ':'))
+    unlink(addr);
 }
 
 /* Create a named pipe and tell libevent to monitor it */
@@ -669,23 +5876,849 @@ static int init_fifo (GlobalInfo *g)
     perror("open");
     exit (1);
   }
-  g->input = fdopen(sockfd, "r");
+  g->input.fd = sockfd;
+  g->input.size = FIFO_READ_SIZE;
+  g->input.buf = (char *)malloc(g->input.size);
+  g->input.lane = -1;
+  if (g->input.buf == NULL) {
+    fprintf(MSG_OUT, "malloc failed!\n");
+    exit (1);
+  }
 
   fprintf(MSG_OUT, "Now, pipe some URL's into > %s\n", fifo);
-    //g->fifo_event = event_new(g->evbase, sockfd, EV_READ|EV_PERSIST, fifo_cb, g);
-  g->fifo_event = event_new(g->evbase, sockfd, EV_PERSIST, fifo_cb, g);
-  struct timeval mytimer = {READ_TIMER_SECONDS,0};
-  event_add(g->fifo_event, &mytimer);
+  g->fifo_event = watch_new(g->loop, sockfd, fifo_cb, g);
+  g->fifo_event->et = 1;  /* read until EAGAIN, or paused until resume_cb */
+  watch_io(g->fifo_event, WATCH_READ);
+
+  g->resume_fd = eventfd(0, EFD_NONBLOCK);
+  if (g->resume_fd == -1) {
+    perror("eventfd");
+    exit (1);
+  }
+  g->resume_event = watch_new(g->loop, g->resume_fd, resume_cb, g);
+  g->resume_event->et = 1;
+  watch_io(g->resume_event, WATCH_READ);
   return (0);
 }
 
 static void clean_fifo(GlobalInfo *g)
 {
-    event_free(g->fifo_event);
-    fclose(g->input);
+    watch_free(g->fifo_event);
+    watch_free(g->resume_event);
+    close(g->resume_fd);
+    close(g->input.fd);
+    free(g->input.buf);
     unlink(fifo);
 }
 
+/* --------------------------------
+   Share
+
+   One CURLSH for every easy handle, so a host resolved or a TLS session
+   negotiated by one shard serves them all. Connections are not shared:
+   a connection can't be watched by two multi handles, a host lives on
+   one shard anyway, and a shared cache would not be held to
+   CURLMOPT_MAXCONNECTS, which keeps the idle ones per shard in check. */
+
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+
+static void share_lock(CURL *easy, curl_lock_data data,
+                       curl_lock_access access, void *userp)
+{
+  (void)easy;
+  (void)access;
+  (void)userp;
+  pthread_mutex_lock(&share_locks[data]);
+}
+
+static void share_unlock(CURL *easy, curl_lock_data data, void *userp)
+{
+  (void)easy;
+  (void)userp;
+  pthread_mutex_unlock(&share_locks[data]);
+}
+
+static CURLSH *share_new(void)
+{
+  CURLSH *share = curl_share_init();
+  int i;
+
+  if (!share) {
+    fprintf(MSG_OUT, "curl_share_init() failed, exiting!\n");
+    exit(2);
+  }
+  for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    pthread_mutex_init(&share_locks[i], NULL);
+  curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+  curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_PSL);
+  return share;
+}
+
+/* After every easy handle using it is gone */
+static void share_free(CURLSH *share)
+{
+  int i;
+
+  curl_share_cleanup(share);
+  for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    pthread_mutex_destroy(&share_locks[i]);
+}
+
+/* Set up one event loop and its multi handle */
+static void shard_init(GlobalInfo *g, GlobalInfo *shards, int id,
+                       PersistStage *persist, ValidatorStore *validators,
+                       CURLSH *share, const LoopConfig *cfg)
+{
+  g->id = id;
+  g->shards = shards;
+  g->nshards = FETCH_THREADS;
+  g->persist = persist;
+  g->validators = validators;
+  g->share = share;
+  g->hosts = (HostBytes *)calloc(HOST_STATS_SLOTS, sizeof(HostBytes));
+  g->host_last_pages = (long *)calloc(HOST_STATS_SLOTS, sizeof(long));
+  if (g->hosts == NULL || g->host_last_pages == NULL) {
+    fprintf(MSG_OUT, "calloc failed!\n");
+    exit (1);
+  }
+  g->max_in_flight = MAX_PARALLEL_WORKER / FETCH_THREADS;
+  if (g->max_in_flight < 1)
+    g->max_in_flight = 1;
+  g->loop = loop_new(cfg);
+  g->multi = curl_multi_init();
+  g->timer_event = watch_new(g->loop, -1, timer_cb, g);
+  g->sched_event = watch_new(g->loop, -1, sched_cb, g);
+  g->retry_event = watch_new(g->loop, -1, retry_cb, g);
+  g->deadline_event = watch_new(g->loop, -1, deadline_cb, g);
+  g->rng = ((uint64_t)now_us() << 8 | (uint64_t)id) | 1;
+  g->hq_mask = 255;
+  g->hq_table = (HostQueue **)calloc(g->hq_mask + 1, sizeof(HostQueue *));
+  if (g->hq_table == NULL) {
+    fprintf(MSG_OUT, "calloc failed!\n");
+    exit (1);
+  }
+
+  pthread_mutex_init(&g->inbox_lock, NULL);
+  g->inbox_fd = eventfd(0, EFD_NONBLOCK);
+  if (g->inbox_fd == -1) {
+    perror("eventfd");
+    exit (1);
+  }
+  g->inbox_event = watch_new(g->loop, g->inbox_fd, inbox_cb, g);
+  g->inbox_event->et = 1;
+  watch_io(g->inbox_event, WATCH_READ);
+
+  /* setup the generic multi interface options we want */
+  curl_multi_setopt(g->multi, CURLMOPT_SOCKETFUNCTION, sock_cb);
+  curl_multi_setopt(g->multi, CURLMOPT_SOCKETDATA, g);
+  curl_multi_setopt(g->multi, CURLMOPT_TIMERFUNCTION, multi_timer_cb);
+  curl_multi_setopt(g->multi, CURLMOPT_TIMERDATA, g);
+  /* hosts are routed to one shard, so the host cap holds overall */
+  curl_multi_setopt(g->multi, CURLMOPT_PIPELINING,
+                    HTTP2 ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING);
+  curl_multi_setopt(g->multi, CURLMOPT_MAX_CONCURRENT_STREAMS,
+                    (long)MAX_STREAMS);
+  curl_multi_setopt(g->multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+                    (long)MAX_HOST_CONNECTIONS);
+  curl_multi_setopt(g->multi, CURLMOPT_MAXCONNECTS,
+                    CONN_CACHE_MAX / FETCH_THREADS > 0 ?
+                    (long)(CONN_CACHE_MAX / FETCH_THREADS) : 1L);
+  if (MAX_TOTAL_CONNECTIONS)
+    curl_multi_setopt(g->multi, CURLMOPT_MAX_TOTAL_CONNECTIONS,
+                      MAX_TOTAL_CONNECTIONS / FETCH_THREADS > 0 ?
+                      (long)(MAX_TOTAL_CONNECTIONS / FETCH_THREADS) : 1L);
+}
+
+static void shard_cleanup(GlobalInfo *g)
+{
+  curl_multi_cleanup(g->multi);  /* drops the socket watchers */
+  conn_pool_free(g);
+  sock_pool_free(g);
+  free(g->hosts);
+  free(g->host_last_pages);
+  sched_free(g);
+  watch_free(g->sched_event);
+  retry_free(g);
+  watch_free(g->retry_event);
+  free(g->deadline_heap);
+  watch_free(g->deadline_event);
+  watch_free(g->inbox_event);
+  close(g->inbox_fd);
+  pthread_mutex_destroy(&g->inbox_lock);
+  watch_free(g->timer_event);
+  loop_free(g->loop);
+}
+
+/* Loop thread of shards 1..FETCH_THREADS-1 */
+static void *shard_main(void *arg)
+{
+  GlobalInfo *g = (GlobalInfo *)arg;
+
+  g->loop->ops->run(g->loop);
+  return NULL;
+}
+
+/* --------------------------------
+   Self-test
+
+   -T checks the invariants the engine leans on where a bug wouldn't show
+   as a crash, only as URLs started late, twice or never. Each test prints
+   a line; the exit status is 1 if any failed, so a build can run
+   "./a.out -T". Random inputs come from a fixed seed and every run is
+   the same. */
+
+static int test_failed;
+static uint64_t test_rng = 0x9e3779b97f4a7c15ULL;
+
+#define TEST_EXPECT(cond) \
+  do { if (!(cond)) test_fail(__func__, __LINE__, #cond); } while (0)
+
+static void test_fail(const char *fn, int line, const char *cond)
+{
+  if (test_failed++ < 20)
+    fprintf(MSG_OUT, "  %s:%d: %s\n", fn, line, cond);
+}
+
+/* xorshift64* */
+static uint64_t test_rand(void)
+{
+  test_rng ^= test_rng >> 12;
+  test_rng ^= test_rng << 25;
+  test_rng ^= test_rng >> 27;
+  return test_rng * 0x2545F4914F6CDD1DULL;
+}
+
+static GlobalInfo *test_shard(const LoopConfig *cfg)
+{
+  GlobalInfo *g = (GlobalInfo *)calloc(1, sizeof(GlobalInfo));
+
+  if (g == NULL) {
+    fprintf(MSG_OUT, "calloc failed!\n");
+    exit (1);
+  }
+  g->loop = loop_new(cfg);
+  g->sched_event = watch_new(g->loop, -1, sched_cb, g);
+  g->rng = test_rand() | 1;
+  return g;
+}
+
+static void test_shard_free(GlobalInfo *g)
+{
+  free(g->wait_heap);
+  retry_free(g);
+  watch_free(g->sched_event);
+  loop_free(g->loop);
+  free(g);
+}
+
+/* Hosts out of tokens: the wait heap pops them by next_us, and a host
+   filed by sched_place() has a token again when it comes off */
+static void test_wait_heap(const LoopConfig *cfg)
+{
+  GlobalInfo *g = test_shard(cfg);
+  HostQueue *hq[1000], *top;
+  long long last, now = now_us();
+  int i, j, n = 0, popped = 0;
+
+  for (i = 0; i < 1000; i++) {
+    hq[i] = (HostQueue *)calloc(1, sizeof(HostQueue));
+    if (hq[i] == NULL) {
+      fprintf(MSG_OUT, "calloc failed!\n");
+      exit (1);
+    }
+  }
+  /* pushes and pops interleaved, with ties */
+  for (i = 0; i < 1000; i++) {
+    hq[i]->next_us = (long long)(test_rand() % 500);
+    sched_heap_push(g, hq[i]);
+    n++;
+    if (test_rand() % 3 == 0) {
+      top = sched_heap_pop(g);
+      n--;
+      popped++;
+      TEST_EXPECT(g->wait_len == n);
+      for (j = 0; j < g->wait_len; j++)
+        TEST_EXPECT(top->next_us <= g->wait_heap[j]->next_us);
+    }
+    for (j = 1; j < g->wait_len; j++)
+      TEST_EXPECT(g->wait_heap[(j - 1) / 2]->next_us <= g->wait_heap[j]->next_us);
+  }
+  for (last = -1; g->wait_len; popped++) {
+    top = sched_heap_pop(g);
+    TEST_EXPECT(top->next_us >= last);
+    last = top->next_us;
+  }
+  TEST_EXPECT(popped == 1000);
+
+  if (HOST_RATE > 0) {
+    /* a bucket refills at HOST_RATE up to HOST_BURST */
+    hq[0]->tokens = 0;
+    hq[0]->refill_us = now;
+    sched_refill(hq[0], now + 1000000 / HOST_RATE);
+    TEST_EXPECT(hq[0]->tokens > 0.999 && hq[0]->tokens < 1.001);
+    sched_refill(hq[0], now + 1000000LL * (HOST_BURST + 10) / HOST_RATE);
+    TEST_EXPECT(hq[0]->tokens == HOST_BURST);
+
+    /* short of a token: waits, and has one when it is due */
+    for (i = 1; i < 100; i++) {
+      hq[i]->tokens = (double)(test_rand() % 1000) / 1000;
+      hq[i]->refill_us = now;
+      sched_place(g, hq[i], now);
+      TEST_EXPECT(hq[i]->state == HQ_WAIT);
+    }
+    TEST_EXPECT(g->wait_len == 99);
+    while (g->wait_len) {
+      top = sched_heap_pop(g);
+      sched_refill(top, top->next_us);
+      TEST_EXPECT(top->tokens >= 1);
+    }
+  }
+
+  for (i = 0; i < 1000; i++)
+    free(hq[i]);
+  test_shard_free(g);
+}
+
+/* Retries come off the heap by due time, and keep when they were read */
+static void test_retry_heap(const LoopConfig *cfg)
+{
+  GlobalInfo *g = test_shard(cfg);
+  PendingUrl *p;
+  long long last;
+  int i, j, n = 0, popped = 0;
+
+  for (i = 0; i < 1000; i++) {
+    p = pending_new("http://a/", 9, 0);
+    p->queued_us = i;
+    p->due_us = (long long)(test_rand() % 500);
+    retry_heap_push(g, p);
+    n++;
+    if (test_rand() % 3 == 0) {
+      p = retry_heap_pop(g);
+      n--;
+      popped++;
+      for (j = 0; j < g->retry_len; j++)
+        TEST_EXPECT(p->due_us <= g->retry_heap[j]->due_us);
+      free(p);
+    }
+    TEST_EXPECT(g->retry_len == n);
+    for (j = 1; j < g->retry_len; j++)
+      TEST_EXPECT(g->retry_heap[(j - 1) / 2]->due_us <= g->retry_heap[j]->due_us);
+  }
+  for (last = -1; g->retry_len; popped++) {
+    p = retry_heap_pop(g);
+    TEST_EXPECT(p->due_us >= last);
+    TEST_EXPECT(p->queued_us >= 0 && p->queued_us < 1000);
+    last = p->due_us;
+    free(p);
+  }
+  TEST_EXPECT(popped == 1000);
+  test_shard_free(g);
+}
+
+/* Backoffs stay within [half, all] of the capped doubling, are spread
+   across that range, and never undercut a Retry-After */
+static void test_backoff(const LoopConfig *cfg)
+{
+  GlobalInfo *g = test_shard(cfg);
+  long long full, d, lo, hi;
+  int cls, attempt, i;
+
+  for (cls = 0; cls < RETRY_CLASSES; cls++)
+    for (attempt = 0; attempt < 30; attempt++) {
+      full = (long long)retry_base_ms[cls] << (attempt < 20 ? attempt : 20);
+      if (full > RETRY_MAX_MS)
+        full = RETRY_MAX_MS;
+      lo = full;
+      hi = 0;
+      for (i = 0; i < 200; i++) {
+        d = retry_delay(g, cls, attempt, 0);
+        TEST_EXPECT(d >= full - full / 2 && d <= full);
+        TEST_EXPECT(d <= RETRY_MAX_MS);
+        if (d < lo)
+          lo = d;
+        if (d > hi)
+          hi = d;
+      }
+      TEST_EXPECT(full < 100 || hi - lo > full / 4);  /* jittered */
+      d = retry_delay(g, cls, attempt, full + 1);
+      TEST_EXPECT(d == full + 1);
+      d = retry_delay(g, cls, attempt, 1);
+      TEST_EXPECT(d >= full - full / 2);
+    }
+  test_shard_free(g);
+}
+
+/* Follow a transfer from one deadline to the next the way deadline_cb()
+   does, rate bytes arriving per step; returns what reaped it, -1 if none
+   did. Every check must be later than the last, or the timer spins. */
+static int test_reap(ConnInfo *conn, long long first_rx_us, long rate,
+                     long long *when)
+{
+  long long d, now = conn->start_us;
+  int step, reaped = -1;
+
+  conn->first_rx_us = first_rx_us;
+  conn->window_us = 0;
+  conn->rx_bytes = first_rx_us ? 1 : 0;
+  for (step = 0; step < 100000 && reaped < 0; step++) {
+    d = deadline_next(conn);
+    if (!d)
+      break;
+    TEST_EXPECT(d > now);
+    if (d <= now)
+      break;
+    now = d;
+    conn->rx_bytes += rate;
+    reaped = deadline_check(conn, now);
+  }
+  *when = now - conn->start_us;
+  return reaped;
+}
+
+/* The deadline heap keeps its order and every slot's deadline_idx through
+   adds and removals from the middle; a silent, a stalled and a busy
+   transfer are reaped for the right reason at the right time */
+static void test_deadline_heap(const LoopConfig *cfg)
+{
+  GlobalInfo *g = test_shard(cfg);
+  ConnInfo *conn = (ConnInfo *)calloc(1000, sizeof(ConnInfo)), *top;
+  long long last, when;
+  int i, j, live = 0, r;
+
+  if (conn == NULL) {
+    fprintf(MSG_OUT, "calloc failed!\n");
+    exit (1);
+  }
+  for (i = 0; i < 1000; i++) {
+    conn[i].deadline_idx = -1;
+    conn[i].deadline_us = (long long)(test_rand() % 500);
+    deadline_add(g, &conn[i]);
+    live++;
+    if (test_rand() % 3 == 0) {
+      /* an earlier transfer finishes */
+      j = (int)(test_rand() % (i + 1));
+      live -= conn[j].deadline_idx >= 0;
+      deadline_del(g, &conn[j]);
+      TEST_EXPECT(conn[j].deadline_idx == -1);
+    }
+    TEST_EXPECT(g->deadline_len == live);
+    for (j = 0; j < g->deadline_len; j++) {
+      TEST_EXPECT(g->deadline_heap[j]->deadline_idx == j);
+      if (j)
+        TEST_EXPECT(g->deadline_heap[(j - 1) / 2]->deadline_us <=
+                    g->deadline_heap[j]->deadline_us);
+    }
+  }
+  for (last = -1; g->deadline_len; live--) {
+    top = g->deadline_heap[0];
+    TEST_EXPECT(top->deadline_us >= last);
+    last = top->deadline_us;
+    deadline_del(g, top);
+  }
+  TEST_EXPECT(live == 0);
+
+  top = &conn[0];
+  top->start_us = 1000000000LL;
+  /* still waiting for a connection inside curl: only the total runs */
+  r = test_reap(top, 0, 0, &when);
+  if (TOTAL_TIMEOUT_MS > 0) {
+    TEST_EXPECT(r == REAP_TOTAL);
+    TEST_EXPECT(when == TOTAL_TIMEOUT_MS * 1000LL);
+  } else
+    TEST_EXPECT(r == -1);
+  /* connected after a while in curl's queue: the first byte is awaited
+     from then on */
+  top->connected_us = top->start_us + 5000000LL;
+  r = test_reap(top, 0, 0, &when);
+  if (FIRST_BYTE_TIMEOUT_MS &&
+      (TOTAL_TIMEOUT_MS <= 0 || 5000 + FIRST_BYTE_TIMEOUT_MS < TOTAL_TIMEOUT_MS)) {
+    TEST_EXPECT(r == REAP_FIRST_BYTE);
+    TEST_EXPECT(when == 5000000LL + FIRST_BYTE_TIMEOUT_MS * 1000LL);
+  }
+  top->connected_us = top->start_us;
+  r = test_reap(top, 0, 0, &when);
+  if (FIRST_BYTE_TIMEOUT_MS) {
+    TEST_EXPECT(r == REAP_FIRST_BYTE);
+    TEST_EXPECT(when == FIRST_BYTE_TIMEOUT_MS * 1000LL);
+  } else if (LOW_SPEED_MS)
+    TEST_EXPECT(r == REAP_LOW_SPEED);
+  r = test_reap(top, top->start_us + 1000, 0, &when);
+  if (LOW_SPEED_MS) {
+    TEST_EXPECT(r == REAP_LOW_SPEED);
+    TEST_EXPECT(when == 1000 + LOW_SPEED_MS * 1000LL);
+  }
+  r = test_reap(top, top->start_us + 1000, LOW_SPEED_BYTES, &when);
+  if (TOTAL_TIMEOUT_MS > 0) {
+    TEST_EXPECT(r == REAP_TOTAL);
+    TEST_EXPECT(when == TOTAL_TIMEOUT_MS * 1000LL);
+  } else
+    TEST_EXPECT(r == -1);
+
+  free(conn);
+  free(g->deadline_heap);
+  test_shard_free(g);
+}
+
+/* A scratch file for a structure that lives in one; unlinked by the
+   caller once the structure is closed */
+static void test_path(char *path, size_t size)
+{
+  int fd;
+
+  snprintf(path, size, "/tmp/hiper.test.XXXXXX");
+  fd = mkstemp(path);
+  if (fd == -1) {
+    perror("mkstemp");
+    exit (1);
+  }
+  close(fd);
+}
+
+/* No false negatives, few false positives, the TTL across the wrap of
+   the minute counter, forgetting, URLs being fetched, and kicks in a
+   nearly full table */
+static void test_seen_filter(const LoopConfig *cfg)
+{
+  char path[64], url[64];
+  SeenFilter *sf;
+  unsigned int m = 0xffff - 5;  /* the TTL runs across the wrap */
+  long miss = 0, fp = 0;
+  size_t busy;
+  int i, n;
+  (void)cfg;
+
+  if (SEEN_TTL_MINUTES <= 0)
+    return;
+  test_path(path, sizeof(path));
+  sf = seen_open(path);
+  TEST_EXPECT(sf != NULL);
+  if (sf == NULL)
+    return;
+
+  for (i = 0; i < 100000; i++) {
+    n = snprintf(url, sizeof(url), "http://h%d.example/p%d", i % 977, i);
+    seen_mark(sf, url, m);
+  }
+  for (i = 0; i < 100000; i++) {
+    n = snprintf(url, sizeof(url), "http://h%d.example/p%d", i % 977, i);
+    miss += !seen_check(sf, url, n, m + SEEN_TTL_MINUTES - 1);
+    n = snprintf(url, sizeof(url), "http://h%d.example/q%d", i % 977, i);
+    fp += seen_check(sf, url, n, m);  /* never marked */
+  }
+  TEST_EXPECT(sf->overflows == 0);
+  TEST_EXPECT(miss == 0);
+  TEST_EXPECT(fp < 100);
+  n = snprintf(url, sizeof(url), "http://h0.example/p0");
+  TEST_EXPECT(!seen_check(sf, url, n, m + SEEN_TTL_MINUTES));
+
+  /* forgotten URLs are fetched again, the rest are still skipped */
+  for (i = 0; i < 100000; i += 2) {
+    snprintf(url, sizeof(url), "http://h%d.example/p%d", i % 977, i);
+    seen_forget(sf, url, m);
+  }
+  for (i = miss = fp = 0; i < 100000; i++) {
+    n = snprintf(url, sizeof(url), "http://h%d.example/p%d", i % 977, i);
+    if (i % 2)
+      miss += !seen_check(sf, url, n, m);
+    else
+      fp += seen_check(sf, url, n, m);
+  }
+  TEST_EXPECT(miss == 0);
+  TEST_EXPECT(fp < 100);
+
+  /* a URL read again while it is being fetched is skipped, until its
+     fetch ends one way or the other */
+  busy = sf->busy_count;  /* the misses above are being fetched too */
+  n = snprintf(url, sizeof(url), "http://busy.example/");
+  TEST_EXPECT(!seen_check(sf, url, n, m));
+  TEST_EXPECT(seen_check(sf, url, n, m));
+  seen_release(sf, url);
+  TEST_EXPECT(!seen_check(sf, url, n, m));
+  seen_mark(sf, url, m);
+  TEST_EXPECT(seen_check(sf, url, n, m));
+  seen_forget(sf, url, m);
+  TEST_EXPECT(!seen_check(sf, url, n, m));
+  seen_forget(sf, url, m);
+  TEST_EXPECT(sf->busy_count == busy);
+  for (i = 0; i < 5000; i++) {
+    n = snprintf(url, sizeof(url), "http://busy.example/%d", i);
+    TEST_EXPECT(!seen_check(sf, url, n, m));
+  }
+  for (i = 1; i < 5000; i += 2) {
+    snprintf(url, sizeof(url), "http://busy.example/%d", i);
+    seen_release(sf, url);
+  }
+  for (i = miss = fp = 0; i < 5000; i++) {
+    n = snprintf(url, sizeof(url), "http://busy.example/%d", i);
+    if (i % 2)
+      fp += seen_check(sf, url, n, m);  /* released, busy again now */
+    else
+      miss += !seen_check(sf, url, n, m);
+  }
+  TEST_EXPECT(miss == 0);
+  TEST_EXPECT(fp < 5);  /* a fingerprint may still match the filter */
+  TEST_EXPECT(sf->busy_count == busy + 5000);
+
+  /* a small table filled to 95%: entries move to their other bucket
+     instead of being lost, unless the kicks run out */
+  memset(sf->table, 0, (sf->mask + 1) * SEEN_SLOTS * 4);
+  sf->mask = 255;
+  for (i = 0; i < 973; i++) {
+    snprintf(url, sizeof(url), "http://full.example/%d", i);
+    seen_mark(sf, url, m);
+  }
+  for (i = miss = 0; i < 973; i++) {
+    n = snprintf(url, sizeof(url), "http://full.example/%d", i);
+    miss += !seen_check(sf, url, n, m);
+  }
+  TEST_EXPECT(miss <= sf->overflows);
+  TEST_EXPECT(sf->overflows < 10);
+
+  seen_close(sf);
+  unlink(path);
+}
+
+/* Known XXH64 values, in one piece and fed in odd-sized parts */
+static void test_xxh64(const LoopConfig *cfg)
+{
+  static const struct { size_t len; uint64_t h; } known[] = {
+    {0, 0xef46db3751d8e999ULL}, {31, 0xa2aa5f33cc4a6119ULL},
+    {32, 0x23c3c17ef790fd97ULL}, {100, 0xa61f8d4c170fe531ULL},
+    {1000, 0x5f235fa033f1a3fbULL},
+  };
+  unsigned char data[1000];
+  size_t i, off, part;
+  Xxh64 st;
+  (void)cfg;
+
+  TEST_EXPECT(xxh64("a", 1, 0) == 0xd24ec4f1a98c6e5bULL);
+  TEST_EXPECT(xxh64("abc", 3, 0) == 0x44bc2cf5ad770999ULL);
+  for (i = 0; i < sizeof(data); i++)
+    data[i] = (unsigned char)(i * 7 + 3);
+  TEST_EXPECT(xxh64(data, 100, 1) == 0x8d8957e68f02c7ceULL);
+  for (i = 0; i < sizeof(known) / sizeof(known[0]); i++) {
+    TEST_EXPECT(xxh64(data, known[i].len, 0) == known[i].h);
+    xxh64_reset(&st, 0);
+    for (off = 0, part = 1; off < known[i].len; off += part, part += 6) {
+      if (part > known[i].len - off)
+        part = known[i].len - off;
+      xxh64_update(&st, data + off, part);
+    }
+    TEST_EXPECT(xxh64_digest(&st) == known[i].h);
+  }
+}
+
+/* Claims, drops from the middle of probe runs, commits and the reload */
+static void test_digest_index(const LoopConfig *cfg)
+{
+  enum { N = 100000 };
+  char path[64];
+  DigestIndex *di;
+  uint64_t *d = (uint64_t *)malloc(N * sizeof(uint64_t));
+  size_t i, stored = 0;
+  (void)cfg;
+
+  if (d == NULL) {
+    fprintf(MSG_OUT, "malloc failed!\n");
+    exit (1);
+  }
+  /* random, but for 2000 sharing a few homes so probe runs get long */
+  for (i = 0; i < N; i++)
+    d[i] = i % 2 || i >= 4000 ? test_rand() :
+           (uint64_t)i << 32 | (test_rand() % 4) << 6 | (i / 2 % 3);
+  d[0] = 0;  /* stored as 1 */
+  test_path(path, sizeof(path));
+  di = digest_open(path);
+  for (i = 0; i < N; i++)
+    TEST_EXPECT(digest_claim(di, d[i]) == DIGEST_NEW);
+  TEST_EXPECT(digest_count(di) == 0);
+  /* a second writer with the same body while the claim is open */
+  for (i = 0; i < N; i++)
+    TEST_EXPECT(digest_claim(di, d[i]) == DIGEST_PENDING);
+
+  /* a failed batch gives its claims back, a stored one keeps them */
+  for (i = 0; i < N; i++) {
+    if (i % 3) {
+      digest_commit(di, d[i]);
+      stored++;
+    } else
+      digest_drop(di, d[i]);
+  }
+  TEST_EXPECT(digest_count(di) == stored);
+  for (i = 0; i < N; i++)
+    TEST_EXPECT(digest_claim(di, d[i]) ==
+                (i % 3 ? DIGEST_STORED : DIGEST_NEW));  /* claimed again */
+  for (i = 0; i < N; i += 3)
+    digest_drop(di, d[i]);
+
+  /* writer A claims, writer B stores its copy with the body; A's batch
+     fails: nothing points at A's missing row, and the digest is free */
+  TEST_EXPECT(digest_claim(di, 42) == DIGEST_NEW);
+  TEST_EXPECT(digest_claim(di, 42) == DIGEST_PENDING);
+  digest_drop(di, 42);
+  TEST_EXPECT(digest_claim(di, 42) == DIGEST_NEW);
+  digest_drop(di, 42);
+  digest_close(di);
+
+  /* only committed digests come back */
+  di = digest_open(path);
+  TEST_EXPECT(di->loaded == (long)stored);
+  for (i = 0; i < N; i++)
+    TEST_EXPECT(digest_claim(di, d[i]) ==
+                (i % 3 ? DIGEST_STORED : DIGEST_NEW));
+  digest_close(di);
+  unlink(path);
+  free(d);
+}
+
+#define TEST_RING_ITEMS 200000  /* per producer */
+#define TEST_RING_THREADS 4     /* producers, and as many consumers */
+
+typedef struct _TestRing
+{
+  PersistStage *ps;
+  int id;
+  volatile long *popped;      /* shared count of pages taken */
+  unsigned char *seen;        /* per item, times taken */
+} TestRing;
+
+static PersistStage *test_ring_new(size_t size)
+{
+  PersistStage *ps = (PersistStage *)calloc(1, sizeof(PersistStage));
+  size_t i;
+
+  if (ps == NULL ||
+      (ps->cells = (PageQueueCell *)calloc(size, sizeof(PageQueueCell))) == NULL) {
+    fprintf(MSG_OUT, "calloc failed!\n");
+    exit (1);
+  }
+  ps->mask = size - 1;
+  for (i = 0; i < size; i++)
+    ps->cells[i].seq = i;
+  sem_init(&ps->items, 0, 0);
+  return ps;
+}
+
+static void test_ring_free(PersistStage *ps)
+{
+  sem_destroy(&ps->items);
+  free(ps->cells);
+  free(ps);
+}
+
+/* Items are tagged pointers, never dereferenced */
+static void *test_ring_producer(void *arg)
+{
+  TestRing *t = (TestRing *)arg;
+  size_t i, item;
+
+  for (i = 0; i < TEST_RING_ITEMS; i++) {
+    item = (size_t)t->id * TEST_RING_ITEMS + i + 1;
+    while (!persist_push(t->ps, (StoredPage *)item))
+      sched_yield();  /* full */
+  }
+  return NULL;
+}
+
+static void *test_ring_consumer(void *arg)
+{
+  TestRing *t = (TestRing *)arg;
+  StoredPage *sp;
+
+  while (__atomic_load_n(t->popped, __ATOMIC_RELAXED) <
+         TEST_RING_ITEMS * TEST_RING_THREADS) {
+    if ((sp = persist_pop(t->ps)) == NULL) {
+      sched_yield();  /* empty */
+      continue;
+    }
+    __atomic_add_fetch(&t->seen[(size_t)sp - 1], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(t->popped, 1, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+/* The writers' ring: full and empty at the edges, FIFO across many
+   laps, and every page taken exactly once with threads on both ends */
+static void test_page_ring(const LoopConfig *cfg)
+{
+  PersistStage *ps = test_ring_new(8);
+  TestRing t[2 * TEST_RING_THREADS];
+  pthread_t tid[2 * TEST_RING_THREADS];
+  volatile long popped = 0;
+  unsigned char *seen;
+  size_t i, lap, bad;
+  (void)cfg;
+
+  for (lap = 0; lap < 1000; lap++) {
+    for (i = 0; i < 8; i++)
+      TEST_EXPECT(persist_push(ps, (StoredPage *)(lap * 8 + i + 1)));
+    TEST_EXPECT(!persist_push(ps, (StoredPage *)1));
+    TEST_EXPECT(persist_depth(ps) == 8);
+    for (i = 0; i < 8; i++)
+      TEST_EXPECT(persist_pop(ps) == (StoredPage *)(lap * 8 + i + 1));
+    TEST_EXPECT(persist_pop(ps) == NULL);
+  }
+  test_ring_free(ps);
+
+  ps = test_ring_new(64);
+  seen = (unsigned char *)calloc(TEST_RING_ITEMS * TEST_RING_THREADS, 1);
+  if (seen == NULL) {
+    fprintf(MSG_OUT, "calloc failed!\n");
+    exit (1);
+  }
+  for (i = 0; i < 2 * TEST_RING_THREADS; i++) {
+    t[i].ps = ps;
+    t[i].id = (int)(i % TEST_RING_THREADS);
+    t[i].popped = &popped;
+    t[i].seen = seen;
+    if (pthread_create(&tid[i], NULL, i < TEST_RING_THREADS ?
+                       test_ring_producer : test_ring_consumer, &t[i])) {
+      perror("pthread_create");
+      exit (1);
+    }
+  }
+  for (i = 0; i < 2 * TEST_RING_THREADS; i++)
+    pthread_join(tid[i], NULL);
+  for (i = bad = 0; i < TEST_RING_ITEMS * TEST_RING_THREADS; i++)
+    bad += seen[i] != 1;
+  TEST_EXPECT(bad == 0);
+  TEST_EXPECT(persist_pop(ps) == NULL);
+  free(seen);
+  test_ring_free(ps);
+}
+
+static const struct {
+  const char *name;
+  void (*run)(const LoopConfig *cfg);
+} tests[] = {
+  {"wait heap", test_wait_heap},
+  {"retry heap", test_retry_heap},
+  {"backoff", test_backoff},
+  {"deadline heap", test_deadline_heap},
+  {"seen filter", test_seen_filter},
+  {"xxh64", test_xxh64},
+  {"digest index", test_digest_index},
+  {"page ring", test_page_ring},
+};
+
+static int self_test(const LoopConfig *cfg)
+{
+  size_t i;
+  int before;
+
+  for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+    before = test_failed;
+    tests[i].run(cfg);
+    fprintf(MSG_OUT, "%s: %s\n", tests[i].name,
+            test_failed == before ? "ok" : "FAILED");
+  }
+  return test_failed ? 1 : 0;
+}
+
 int main(int argc, char **argv)
 {
 	//setlocale (LC_ALL, "nl_NL.utf8" );
@@ -694,17 +6727,45 @@ int main(int argc, char **argv)
 	// 3rd lib info
 	printf(curl_version());
 	printf("\n");
+
+  /* I don't like select, as test_libevent.c says */
+  LoopConfig cfg = { "libevent", NULL, "select", 0, 0 };
+  int opt, bench_only = 0, test_only = 0;
+
+  while ((opt = getopt(argc, argv, "b:m:a:ecBT")) != -1) {
+    switch (opt) {
+      case 'b': cfg.backend = optarg; break;
+      case 'm': cfg.method = optarg; break;
+      case 'a': cfg.avoid = optarg; break;
+      case 'e': cfg.edge = 1; break;
+      case 'c': cfg.changelist = 1; break;
+      case 'B': bench_only = 1; break;
+      case 'T': test_only = 1; break;
+      default:
+        fprintf(MSG_OUT, "usage: %s [-b libevent|libev|epoll] [-m method] "
+                "[-a avoid,...] [-e] [-c] [-B] [-T] [conninfo]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (bench_only) {
+    loop_bench(&cfg);
+    return 0;
+  }
+  if (test_only)
+    return self_test(&cfg);
 		
-#ifdef MYSQL_DB
-	//printf("MySQL client version: %s\n", mysql_get_client_info());return 0;		
-	g_pConn = mysql_init(NULL);
-	//mysql_real_connect(g_pConn, "192.168.4.192", "root", "123456", "mydomain", 0, NULL, 0);	
-	mysql_real_connect(g_pConn, "localhost", "root", "30083012", "mydomain", 0, NULL, 0);	
-	//mysql_real_connect(g_pConn, "192.168.1.102", "root", "123456", "test", 0, NULL, 0);	
-#else
-	g_pConn = PQconnectdb("host='192.168.21.90' port='5432' dbname='test' user='pguser' password='123456' connect_timeout='1000'");
-	if(0 != PQsetClientEncoding(g_pConn, "EUC_CN"))		fprintf(MSG_OUT, "PQsetClientEncoding() failed");
-#endif	
+  /* the writers record validators, forget seen URLs and write dead
+     letters too, so all three are open before they start */
+  ValidatorStore *validators = validators_open(VALIDATOR_FILE);
+  fprintf(MSG_OUT, "%ld validators loaded from %s\n", validators->loaded,
+          VALIDATOR_FILE);
+  struct _SeenFilter *seen = seen_open(SEEN_FILE);
+  dead_fd = open(DEAD_LETTER_FILE, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (dead_fd == -1)
+    perror("open(dead letters)");
+	/* PostgreSQL: the argument after the options, if any, is the conninfo */
+	PersistStage *persist = persist_start(optind < argc ? argv[optind] : NULL,
+	                                      validators, seen, WRITER_THREADS);
 
 	/*
 	mysql_query(conn, "CREATE TABLE writers(name VARCHAR(25))");
@@ -716,43 +6777,62 @@ int main(int argc, char **argv)
 	mysql_query(conn, "INSERT INTO writers VALUES('Emile Zola')");
 	*/   
 
-  GlobalInfo g;
-  (void)argc;
-  (void)argv;
+  GlobalInfo *shards = (GlobalInfo *)calloc(FETCH_THREADS, sizeof(GlobalInfo));
+  GlobalInfo *g = &shards[0];
+  int i;
 
-  memset(&g, 0, sizeof(GlobalInfo));
-  g.evbase = event_base_new();
-  init_fifo(&g);
-  g.multi = curl_multi_init();
-  g.timer_event = evtimer_new(g.evbase, timer_cb, &g);
+  if (shards == NULL) {
+    fprintf(MSG_OUT, "calloc failed!\n");
+    exit (1);
+  }
+  curl_global_init(CURL_GLOBAL_ALL);  /* before any thread touches curl */
+  CURLSH *share = share_new();
+  for (i = 0; i < FETCH_THREADS; i++)
+    shard_init(&shards[i], shards, i, persist, validators, share, &cfg);
+  fprintf(MSG_OUT, "event loop: %s, method %s%s\n", cfg.backend,
+          g->loop->method, g->loop->edge ? ", edge-triggered" : "");
 
-  /* setup the generic multi interface options we want */
-  curl_multi_setopt(g.multi, CURLMOPT_SOCKETFUNCTION, sock_cb);
-  curl_multi_setopt(g.multi, CURLMOPT_SOCKETDATA, &g);
-  curl_multi_setopt(g.multi, CURLMOPT_TIMERFUNCTION, multi_timer_cb);
-  curl_multi_setopt(g.multi, CURLMOPT_TIMERDATA, &g);
-	//curl_multi_setopt(g.multi, CURLMOPT_PIPELINING, 1L);	
+  for (i = 0; i < FETCH_THREADS; i++)
+    shards[i].seen = seen;
+  init_fifo(g);
+  metrics_start(g, METRICS_LISTEN);
+  g->stats_event = watch_new(g->loop, -1, stats_cb, g);
+  watch_timer(g->stats_event, STATS_SECONDS * 1000);
 
   /* we don't call any curl_multi_socket*() function yet as we have no handles
      added! */
 
-  // it's the same as event_base_loop(), with no flags set
-  event_base_dispatch(g.evbase);
+  for (i = 1; i < FETCH_THREADS; i++)
+    if (pthread_create(&shards[i].tid, NULL, shard_main, &shards[i])) {
+      perror("pthread_create");
+      exit (1);
+    }
+
+  g->loop->ops->run(g->loop);
 
   /* this, of course, won't get called since only way to stop this program is
      via ctrl-C, but it is here to show how cleanup /would/ be done. */
-  clean_fifo(&g);
-  event_free(g.timer_event);
-  event_base_free(g.evbase);
-  curl_multi_cleanup(g.multi);
+  clean_fifo(g);
+  metrics_stop(g, METRICS_LISTEN);
+  watch_free(g->stats_event);
+  for (i = 1; i < FETCH_THREADS; i++) {
+    uint64_t one = 1;
+    __atomic_store_n(&shards[i].stopping, 1, __ATOMIC_RELEASE);
+    if (write(shards[i].inbox_fd, &one, sizeof(one)) != sizeof(one))
+      perror("write(eventfd)");
+    pthread_join(shards[i].tid, NULL);
+  }
+  for (i = 0; i < FETCH_THREADS; i++)
+    shard_cleanup(&shards[i]);
+  share_free(share);
+  free(shards);
 	//libevent_global_shutdown();
 	
-#ifdef MYSQL_DB
-  //mysql_query(g_pConn, "INSERT INTO writers (name,size) VALUES('done!', 9)");
-  mysql_close(g_pConn);
-#else
-  PQfinish(g_pConn);
-#endif	
+  persist_stop(persist);
+  seen_close(seen);  /* marked by the shards, forgotten by the writers */
+  validators_close(validators);
+  if (dead_fd != -1)
+    close(dead_fd);
   
   return 0;
 }
@@ -58,6 +58,8 @@ callback.
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <sched.h>
+#include <semaphore.h>
 
 #define DPRINT(x...) printf(x)
 #define DEBUG
@@ -69,6 +71,7 @@ callback.
 #define MAX_PARALLEL_WORKER 150*3 // 12M / 8 = 1.5M * 1000 / 60 = 25
 #define READ_TIMER_SECONDS 4
 #define WEBPAGE_BUF_SIZE 200
+#define STATS_SECONDS 10.
 
 /* Global information, common to all connections */
 typedef struct _GlobalInfo
@@ -76,11 +79,22 @@ typedef struct _GlobalInfo
   struct ev_loop *loop;
   struct ev_io fifo_event;
   struct ev_timer timer_event;
+  struct ev_timer stats_event;
   CURLM *multi;
   int still_running;
   FILE* input;
+  struct _PendingUrl *pending_head; /* URLs waiting for a free buffer */
+  struct _PendingUrl *pending_tail;
+  long pending;
 } GlobalInfo;
 
+/* A URL queued until a page buffer is released */
+typedef struct _PendingUrl
+{
+  struct _PendingUrl *next;
+  char url[1];
+} PendingUrl;
+
 
 /* Information associated with a specific easy handle */
 typedef struct _ConnInfo
@@ -112,13 +126,33 @@ typedef struct _MaxBufWebPage
 	int flag;				// available?
 } MaxBufWebPage;
 
+/* Free list over g_maxBufWebPage.
+ * head packs a version tag (high 32 bits, bumped on every update so a
+ * stale compare-and-swap cannot succeed after an ABA) and the first free
+ * slot + 1 (low 32 bits, 0 = empty).  free_slots counts the slots on the
+ * list, so an acquire only touches the list once a slot is guaranteed. */
+typedef struct _BufPool
+{
+	volatile unsigned long long head;
+	volatile int next[WEBPAGE_BUF_SIZE];
+	sem_t free_slots;
+	volatile long in_use;
+	volatile long high_water;
+	volatile long acquired;
+	volatile long released;
+	volatile long waits;				// acquires that found the pool empty
+} BufPool;
+
 // --------------------------------
 // global var
 static long  				g_share_counter = 0;
 static const char 	*read_fifo = "urls_list.fifo";
 static MaxBufWebPage g_maxBufWebPage[WEBPAGE_BUF_SIZE] = {0};
+static BufPool			g_bufPool;
 
 static void timer_cb(EV_P_ struct ev_timer *w, int revents);
+static void pending_run(GlobalInfo *g);
+static void release_buf_id(int idx);
 
 /* Update the event timer after curl_multi library calls */
 static int multi_timer_cb(CURLM *multi, long timeout_ms, GlobalInfo *g)
@@ -127,13 +161,15 @@ static int multi_timer_cb(CURLM *multi, long timeout_ms, GlobalInfo *g)
   DPRINT("%s %li\n", __PRETTY_FUNCTION__,  timeout_ms);
 #endif
   ev_timer_stop(g->loop, &g->timer_event);
-  if (timeout_ms > 0)
+  if (timeout_ms >= 0)
   {
-    double  t = timeout_ms / 1000;
-    ev_timer_init(&g->timer_event, timer_cb, t, 0.);
+    /* milliseconds; 0 fires on the next loop iteration, never from here:
+       curl does not allow curl_multi_socket_action() inside this callback */
+    double  t = timeout_ms / 1000.;
+    ev_now_update(g->loop);
+    ev_timer_set(&g->timer_event, t, 0.);
     ev_timer_start(g->loop, &g->timer_event);
-  }else
-    timer_cb(g->loop, &g->timer_event, 0);
+  }
   return 0;
 }
 
@@ -201,11 +237,13 @@ static void check_multi_info(GlobalInfo *g)
 // ----------------------------------------------end
 
       curl_multi_remove_handle(g->multi, easy);
+      release_buf_id(conn->buf_id);
       free(conn->url);
       curl_easy_cleanup(easy);
       free(conn);
     }
   }
+  pending_run(g);
 }
 
 
@@ -353,40 +391,158 @@ static int prog_cb (void *p, double dltotal, double dlnow, double ult,
   return 0;
 }
 
-static int get_free_buf_id()
+/* Put every slot on the free list */
+static void buf_pool_init()
 {
-	int i = 0, idx = 0;
-	while(i++ < 10) {
-		idx = 1+(int)(WEBPAGE_BUF_SIZE*1.0*rand()/(RAND_MAX+1.0)) - 1; // [0, WEBPAGE_BUF_SIZE-1]
-		
-		//int *a = &g_maxBufWebPage[idx].flag;
-		//*a = 3000;
-		//return g_maxBufWebPage[idx].flag;
-		
-		if (0 == g_maxBufWebPage[idx].flag) {
-			if (__sync_bool_compare_and_swap(&g_maxBufWebPage[idx].flag, 0, 1)) return idx;
-			else {
-				fprintf(MSG_OUT, "error: %d!\n", g_maxBufWebPage[idx].flag);exit;
-				continue;
-			}
+	int i;
+
+	memset(&g_bufPool, 0, sizeof(BufPool));
+	for (i = 0; i < WEBPAGE_BUF_SIZE; ++i) {
+		g_bufPool.next[i] = i + 1 < WEBPAGE_BUF_SIZE ? i + 1 : -1;
+		g_maxBufWebPage[i].flag = 0;
+	}
+	g_bufPool.head = 1; // slot 0, tag 0
+	sem_init(&g_bufPool.free_slots, 0, WEBPAGE_BUF_SIZE);
+}
+
+/* Pop a slot; the caller already holds one count of free_slots */
+static int buf_pool_pop()
+{
+	unsigned long long old, new_head;
+	int idx;
+
+	do {
+		old = g_bufPool.head;
+		idx = (int)(old & 0xffffffffULL) - 1;
+		if (idx < 0) {
+			/* cannot happen while free_slots is honoured */
+			fprintf(MSG_OUT, "error: buffer pool corrupted!\n");
+			exit(3);
 		}
-		
-		fprintf(MSG_OUT, "error: %d!\n", g_maxBufWebPage[idx].flag);exit;
+		new_head = (((old >> 32) + 1) << 32) |
+			(unsigned int)(g_bufPool.next[idx] + 1);
+	} while (!__sync_bool_compare_and_swap(&g_bufPool.head, old, new_head));
+
+	long used = __sync_add_and_fetch(&g_bufPool.in_use, 1);
+	long high = g_bufPool.high_water;
+	while (used > high &&
+		!__sync_bool_compare_and_swap(&g_bufPool.high_water, high, used))
+		high = g_bufPool.high_water;
+	__sync_fetch_and_add(&g_bufPool.acquired, 1);
+
+	g_maxBufWebPage[idx].cont_len = 0;
+	g_maxBufWebPage[idx].flag = 1;
+	return idx;
+}
+
+/* Take a free buffer without waiting, -1 when all are in use */
+static int get_free_buf_id()
+{
+	if (sem_trywait(&g_bufPool.free_slots) != 0) {
+		__sync_fetch_and_add(&g_bufPool.waits, 1);
+		return -1;
 	}
-	return -1;
+	return buf_pool_pop();
 }
 
-/* Create a new easy handle, and add it to the global curl_multi */
+/* Take a free buffer, sleeping until one is released.
+ * Only for threads other than the loop thread, which is the one releasing. */
+static int get_free_buf_id_wait()
+{
+	if (sem_trywait(&g_bufPool.free_slots) != 0) {
+		__sync_fetch_and_add(&g_bufPool.waits, 1);
+		while (sem_wait(&g_bufPool.free_slots) != 0 && errno == EINTR)
+			;
+	}
+	return buf_pool_pop();
+}
+
+/* Give a buffer back to the pool */
+static void release_buf_id(int idx)
+{
+	unsigned long long old, new_head;
+
+	if (idx < 0 || idx >= WEBPAGE_BUF_SIZE ||
+		!__sync_bool_compare_and_swap(&g_maxBufWebPage[idx].flag, 1, 0)) {
+		fprintf(MSG_OUT, "error: release of free buffer %d!\n", idx);
+		return;
+	}
+
+	do {
+		old = g_bufPool.head;
+		g_bufPool.next[idx] = (int)(old & 0xffffffffULL) - 1;
+		new_head = (((old >> 32) + 1) << 32) | (unsigned int)(idx + 1);
+	} while (!__sync_bool_compare_and_swap(&g_bufPool.head, old, new_head));
+
+	__sync_fetch_and_sub(&g_bufPool.in_use, 1);
+	__sync_fetch_and_add(&g_bufPool.released, 1);
+	sem_post(&g_bufPool.free_slots);
+}
+
+static void buf_pool_stats(FILE *out, GlobalInfo *g)
+{
+	fprintf(out, "bufpool: in use %ld/%d, high %ld, acquired %ld, "
+		"released %ld, waits %ld, queued urls %ld\n",
+		g_bufPool.in_use, WEBPAGE_BUF_SIZE, g_bufPool.high_water,
+		g_bufPool.acquired, g_bufPool.released, g_bufPool.waits,
+		g ? g->pending : 0L);
+}
+
+/* Queue a URL until a buffer frees up */
+static void pending_push(GlobalInfo *g, const char *url)
+{
+	size_t len = strlen(url);
+	PendingUrl *p = malloc(sizeof(PendingUrl) + len);
+
+	if (!p) {
+		fprintf(MSG_OUT, "malloc failed, dropping %s!\n", url);
+		return;
+	}
+	memcpy(p->url, url, len + 1);
+	p->next = NULL;
+	if (g->pending_tail)
+		g->pending_tail->next = p;
+	else
+		g->pending_head = p;
+	g->pending_tail = p;
+	g->pending++;
+}
+
+static void start_conn(char *url, GlobalInfo *g, int idx);
+
+/* Start queued URLs while buffers are available */
+static void pending_run(GlobalInfo *g)
+{
+	PendingUrl *p;
+	int idx;
+
+	while ((p = g->pending_head) && (idx = get_free_buf_id()) != -1) {
+		g->pending_head = p->next;
+		if (!g->pending_head)
+			g->pending_tail = NULL;
+		g->pending--;
+		start_conn(p->url, g, idx);
+		free(p);
+	}
+}
+
+/* Fetch url now if a buffer is free, otherwise queue it */
 static void new_conn(char *url, GlobalInfo *g )
 {
-  ConnInfo *conn;
-  CURLMcode rc;
-	
-	int idx = get_free_buf_id();
-	if (idx == -1) {
-		fprintf(MSG_OUT, "Do nothing because buffer is full!\n");
+	int idx;
+
+	if (g->pending_head || (idx = get_free_buf_id()) == -1) {
+		pending_push(g, url);
 		return;
 	}
+	start_conn(url, g, idx);
+}
+
+/* Create a new easy handle, and add it to the global curl_multi */
+static void start_conn(char *url, GlobalInfo *g, int idx)
+{
+  ConnInfo *conn;
+  CURLMcode rc;
 
   conn = calloc(1, sizeof(ConnInfo));
   memset(conn, 0, sizeof(ConnInfo));
@@ -482,34 +638,47 @@ static int init_fifo (GlobalInfo *g)
   return(0);
 }
 
+/* Print buffer pool occupancy */
+static void stats_cb(EV_P_ struct ev_timer *w, int revents)
+{
+	(void)revents;
+	buf_pool_stats(MSG_OUT, (GlobalInfo *)w->data);
+}
+
 	/* test purpose
 	*/
 int test_case()
 {
+	static int ids[WEBPAGE_BUF_SIZE];
 	memset(&g_maxBufWebPage, 0, sizeof(MaxBufWebPage)*WEBPAGE_BUF_SIZE);
+	buf_pool_init();
 	
 	int i=0;
-	for(i=0; i<10; ++i) {
+	for(i=0; i<WEBPAGE_BUF_SIZE; ++i) {
 		int idx = get_free_buf_id();
 		if (idx >= WEBPAGE_BUF_SIZE) fprintf(MSG_OUT, "error: %d", idx);
 		else if (idx < 0) fprintf(MSG_OUT, "error: %d", idx);
+		ids[i] = idx;
 	}
+	if (get_free_buf_id() != -1) fprintf(MSG_OUT, "error: pool should be empty\n");
+	for(i=0; i<WEBPAGE_BUF_SIZE; i+=2) release_buf_id(ids[i]);
+	for(i=0; i<WEBPAGE_BUF_SIZE; i+=2) {
+		if (get_free_buf_id_wait() < 0) fprintf(MSG_OUT, "error: slot %d not reusable\n", i);
+	}
+	buf_pool_stats(MSG_OUT, NULL);
 	return 0;
 }
 
 int main(int argc, char **argv)
 {
-  unsigned int iseed = (unsigned int)time(NULL);
-  srand (iseed);
-	
 	//return test_case();
 	
   GlobalInfo g;
-  CURLMcode rc;
   (void)argc;
   (void)argv;
 
 	memset(&g_maxBufWebPage, 0, sizeof(MaxBufWebPage)*WEBPAGE_BUF_SIZE);
+	buf_pool_init();
   memset(&g, 0, sizeof(GlobalInfo));
   g.loop = ev_default_loop(0);
 
@@ -519,6 +688,9 @@ int main(int argc, char **argv)
   ev_timer_init(&g.timer_event, timer_cb, 0., 0.);
   g.timer_event.data = &g;
   g.fifo_event.data = &g;
+  ev_timer_init(&g.stats_event, stats_cb, STATS_SECONDS, STATS_SECONDS);
+  g.stats_event.data = &g;
+  ev_timer_start(g.loop, &g.stats_event);
   curl_multi_setopt(g.multi, CURLMOPT_SOCKETFUNCTION, sock_cb);
   curl_multi_setopt(g.multi, CURLMOPT_SOCKETDATA, &g);
   curl_multi_setopt(g.multi, CURLMOPT_TIMERFUNCTION, multi_timer_cb);